@@ -0,0 +1,213 @@
+#include <cstdlib>
+#include <new>
+#include <iostream>
+#include <iomanip>
+#include <unistd.h>
+#include <mongo/client/dbclient.h>
+#include <boost/format.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <mdbq/hub.hpp>
+#include <mdbq/client.hpp>
+#include <mdbq/common.hpp>
+#include <mdbq/date_time.hpp>
+
+/**
+ * Microbenchmark of the client hot path.
+ *
+ * Claims, logs to, checkpoints and finishes a number of tasks and reports
+ * heap allocations and wall time per task, next to the same work done the
+ * way the client did it before the hot path was trimmed (see
+ * BaselineClient). Requires a running mongod:
+ *
+ * @code
+ * $ mdbq_bench_hot_path localhost 1000
+ * @endcode
+ */
+
+static unsigned long long g_n_alloc = 0;
+
+// dynamic exception specifications are gone since C++17
+#if __cplusplus >= 201103L
+#  define BENCH_THROW_BAD_ALLOC
+#  define BENCH_NOTHROW noexcept
+#else
+#  define BENCH_THROW_BAD_ALLOC throw(std::bad_alloc)
+#  define BENCH_NOTHROW throw()
+#endif
+
+void* operator new(std::size_t n) BENCH_THROW_BAD_ALLOC{
+    ++g_n_alloc;
+    void* p = std::malloc(n ? n : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) BENCH_NOTHROW{
+    std::free(p);
+}
+
+using namespace mdbq;
+
+/**
+ * the client's hot path as it was before it was trimmed.
+ *
+ * the owner string is rebuilt and the command written with nested
+ * temporaries on every claim, the claimed task is deep-copied, and log
+ * entries are built as temporaries and copied into an unreserved vector.
+ */
+struct BaselineClient{
+    mongo::DBClientConnection m_con;
+    std::string               m_db;
+    mongo::BSONObj            m_current_task;
+    std::vector<mongo::BSONObj> m_log;
+    long long                 m_running_nr;
+
+    BaselineClient(const std::string& url, const std::string& db)
+        : m_db(db), m_running_nr(0)
+    {
+        m_con.connect(url);
+    }
+    bool get_next_task(mongo::BSONObj& o){
+        boost::posix_time::ptime now = universal_date_time();
+        std::string hostname(256, '\0');
+        gethostname(&hostname[0], 256);
+        std::string hostname_pid = (boost::format("%s:%d") % &hostname[0] % getpid()).str();
+
+        mongo::BSONObjBuilder queryb;
+        mongo::BSONObj res, cmd, query;
+        queryb.append("state", TS_NEW);
+        query = queryb.obj();
+        cmd = BSON(
+                "findAndModify" << "jobs" <<
+                "query" << query <<
+                "update"<<BSON("$set"<<
+                    BSON("book_time"<<to_mongo_date(now)
+                        <<"state"<<TS_RUNNING
+                        <<"result.status"<<"running"
+                        <<"refresh_time"<<to_mongo_date(now)
+                        <<"owner"<<hostname_pid)));
+        m_con.runCommand(m_db, cmd, res);
+        if(!res["value"].isABSONObj())
+            return false;
+        m_current_task = res["value"].Obj().copy();
+        m_running_nr = 0;
+        o = m_current_task["misc"].Obj();
+        m_log.clear();
+        return true;
+    }
+    void log(int level, const mongo::BSONObj& msg){
+        m_log.push_back(BSON(
+                    mongo::GENOID<<
+                    "taskid"<<m_current_task["_id"]<<
+                    "level"<<level<<
+                    "nr" << m_running_nr++ <<
+                    "timestamp"<< to_mongo_date(universal_date_time())<<
+                    "msg"<<msg));
+    }
+    void checkpoint(){
+        m_con.update(m_db+".jobs",
+                QUERY("_id"<<m_current_task["_id"]),
+                BSON("$set"<<BSON("refresh_time"<<to_mongo_date(universal_date_time()))));
+        if(m_log.size()){
+            m_con.insert(m_db+".log", m_log);
+            m_log.clear();
+        }
+    }
+    void finish(const mongo::BSONObj& result){
+        checkpoint();
+        int version = m_current_task["version"].Int();
+        m_con.update(m_db+".jobs",
+                QUERY("_id"<<m_current_task["_id"]<<
+                    "version"<<version),
+                BSON("$set"<<BSON(
+                    "state"<<TS_OK<<
+                    "version"<<version+1<<
+                    "finish_time"<<to_mongo_date(universal_date_time())<<
+                    "result"<<result)));
+        m_current_task = mongo::BSONObj();
+    }
+};
+
+/// allocations per phase, summed over the tasks handled
+struct Counts{
+    unsigned long long claim, log, checkpoint, finish;
+    unsigned int n;   ///< number of tasks handled
+    double ms;
+    Counts():claim(0), log(0), checkpoint(0), finish(0), n(0), ms(0){}
+    double per_task(unsigned long long v)const{ return n ? v / (double)n : 0.; }
+};
+
+template<class C>
+Counts run(C& clt, unsigned int n_tasks, unsigned int n_log){
+    Counts c;
+    mongo::BSONObj task;
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    for (unsigned int i = 0; i < n_tasks; ++i)
+    {
+        unsigned long long n0 = g_n_alloc;
+        if(!clt.get_next_task(task))
+            break;
+        unsigned long long n1 = g_n_alloc;
+        for (unsigned int j = 0; j < n_log; ++j)
+            clt.log(0, BSON("iter"<<j));
+        unsigned long long n2 = g_n_alloc;
+        clt.checkpoint();
+        unsigned long long n3 = g_n_alloc;
+        clt.finish(BSON("loss"<<0.5));
+        unsigned long long n4 = g_n_alloc;
+        c.claim      += n1-n0;
+        c.log        += n2-n1;
+        c.checkpoint += n3-n2;
+        c.finish     += n4-n3;
+        c.n++;
+    }
+    c.ms = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000.;
+    return c;
+}
+
+void insert_jobs(Hub& hub, unsigned int n_tasks){
+    hub.clear_all();
+    std::vector<mongo::BSONObj> jobs;
+    for (unsigned int i = 0; i < n_tasks; ++i)
+        jobs.push_back(BSON("foo"<<i<<"bar"<<i));
+    hub.insert_jobs(jobs, 1000);
+}
+
+void print_row(const char* name, double before, double after){
+    std::cout << "  " << std::left << std::setw(16) << name << std::right
+              << std::setw(10) << before << std::setw(10) << after;
+    if(before > 0)
+        std::cout << std::setw(9) << (int)(100. * (after - before) / before) << "%";
+    std::cout << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string host = argc > 1 ? argv[1] : "localhost";
+    unsigned int n_tasks = argc > 2 ? atoi(argv[2]) : 1000;
+    const unsigned int n_log = 10;
+
+    Hub hub(host, "bench_mdbq");
+    insert_jobs(hub, n_tasks);
+    BaselineClient base(host, "bench_mdbq");
+    Counts b = run(base, n_tasks, n_log);
+
+    insert_jobs(hub, n_tasks);
+    Client clt(host, "bench_mdbq");
+    Counts c = run(clt, n_tasks, n_log);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "allocations per task (" << b.n << " / " << c.n << " tasks)" << std::endl
+              << "  " << std::left << std::setw(16) << "" << std::right
+              << std::setw(10) << "baseline" << std::setw(10) << "client" << std::setw(10) << "change" << std::endl;
+    print_row("get_next_task", b.per_task(b.claim), c.per_task(c.claim));
+    print_row("log (x10)",     b.per_task(b.log), c.per_task(c.log));
+    print_row("checkpoint",    b.per_task(b.checkpoint), c.per_task(c.checkpoint));
+    print_row("finish",        b.per_task(b.finish), c.per_task(c.finish));
+    std::cout << std::setprecision(3);
+    print_row("time [ms]",     b.n ? b.ms / b.n : 0., c.n ? c.ms / c.n : 0.);
+    hub.clear_all();
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __MDBQ_ASYNC_HPP__
+#     define __MDBQ_ASYNC_HPP__
+
+#include <boost/function.hpp>
+#include <boost/exception_ptr.hpp>
+
+namespace mongo
+{
+    class  BSONObj;
+}
+namespace mdbq
+{
+    /**
+     * completion handler of asynchronous operations.
+     *
+     * The argument is empty on success, otherwise it holds the exception
+     * the operation failed with (rethrow with boost::rethrow_exception).
+     */
+    typedef boost::function<void (boost::exception_ptr)> completion_handler;
+
+    /**
+     * completion handler of Client::async_get_next_task.
+     *
+     * arguments are the error (as in completion_handler), whether a task
+     * was acquired, and the task description.
+     */
+    typedef boost::function<void (boost::exception_ptr, bool, const mongo::BSONObj&)> task_handler;
+}
+#endif /* __MDBQ_ASYNC_HPP__ */
@@ -0,0 +1,91 @@
+#include <stdexcept>
+#include "blob.hpp"
+
+namespace mdbq
+{
+    namespace
+    {
+        mongo::GridFile find(mongo::GridFS& fs, const mongo::BSONObj& ref){
+            mongo::GridFile f = fs.findFile(ref["mdbq_blob"].String());
+            if(!f.exists())
+                throw std::runtime_error("MDBQ: blob `" + ref["mdbq_blob"].String() + "' not found");
+            return f;
+        }
+    }
+
+    mongo::BSONObj store_blob(mongo::GridFS& fs, mongo::DBClientConnection& con, const std::string& fscol,
+            const mongo::BSONElement& e, const std::string& filename, const mongo::BSONElement& taskid){
+        std::string kind;
+        mongo::BSONObj wrapped;
+        const char* data;
+        int len;
+        if(e.type() == mongo::BinData){
+            kind = "bin";
+            data = e.binData(len);
+        }else if(e.type() == mongo::String){
+            kind = "str";
+            data = e.valuestr();
+            len  = e.valuestrsize() - 1; // without terminating zero
+        }else{
+            kind = "bson";
+            wrapped = e.wrap("v");
+            data = wrapped.objdata();
+            len  = wrapped.objsize();
+        }
+        fs.storeFile(data, len, filename);
+        mongo::BSONObjBuilder set;
+        set.appendAs(taskid, "taskid");
+        set.append("kind", kind);
+        con.update(fscol + ".files",
+                QUERY("filename" << filename),
+                BSON("$set" << set.obj()));
+        return BSON("mdbq_blob" << filename << "kind" << kind << "bytes" << len);
+    }
+
+    mongo::BSONObj offload_fields(mongo::GridFS& fs, mongo::DBClientConnection& con, const std::string& fscol,
+            const mongo::BSONObj& obj, const mongo::BSONElement& taskid, size_t threshold){
+        if(!threshold || (size_t)obj.objsize() <= threshold)
+            return obj;
+        mongo::BSONObjBuilder bob;
+        mongo::BSONObjIterator it(obj);
+        while(it.more()){
+            mongo::BSONElement e = it.next();
+            if((size_t)e.size() <= threshold){
+                bob.append(e);
+                continue;
+            }
+            std::string filename = "blob:" + taskid.OID().str() + ":" + e.fieldName();
+            bob.append(e.fieldName(), store_blob(fs, con, fscol, e, filename, taskid));
+        }
+        return bob.obj();
+    }
+
+    bool is_blob_ref(const mongo::BSONElement& e){
+        return e.type() == mongo::Object && e.Obj().hasField("mdbq_blob");
+    }
+
+    mongo::BSONObj fetch_blob(mongo::GridFS& fs, const mongo::BSONObj& ref, const std::string& name){
+        mongo::GridFile f = find(fs, ref);
+        std::string buf;
+        buf.reserve(ref["bytes"].numberInt());
+        for(int i = 0; i < f.getNumChunks(); i++){
+            int len;
+            const char* data = f.getChunk(i).data(len);
+            buf.append(data, len);
+        }
+
+        mongo::BSONObjBuilder bob;
+        std::string kind = ref["kind"].String();
+        if(kind == "bin")
+            bob.appendBinData(name, buf.size(), mongo::BinDataGeneral, buf.data());
+        else if(kind == "str")
+            bob.append(name, buf);
+        else
+            bob.appendAs(mongo::BSONObj(buf.data())["v"], name);
+        return bob.obj();
+    }
+
+    void stream_blob(mongo::GridFS& fs, const mongo::BSONObj& ref, std::ostream& os){
+        find(fs, ref).write(os);
+    }
+}
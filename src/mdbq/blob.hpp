@@ -0,0 +1,50 @@
+#ifndef __MDBQ_BLOB_HPP__
+#     define __MDBQ_BLOB_HPP__
+#include <string>
+#include <ostream>
+#include <mongo/client/dbclient.h>
+#include <mongo/client/gridfs.h>
+
+namespace mdbq
+{
+    /**
+     * store a value in GridFS and return a reference document to it.
+     *
+     * binary data and strings are stored as raw bytes, everything else as
+     * a BSON document. The GridFS file is tagged with the task id, so
+     * that files of vanished tasks can be found.
+     *
+     * @param fs the GridFS of the queue
+     * @param con connection of fs
+     * @param fscol GridFS collection prefix (db.fs)
+     * @param e the value to store
+     * @param filename name of the GridFS file
+     * @param taskid element holding the _id of the task
+     */
+    mongo::BSONObj store_blob(mongo::GridFS& fs, mongo::DBClientConnection& con, const std::string& fscol,
+            const mongo::BSONElement& e, const std::string& filename, const mongo::BSONElement& taskid);
+
+    /**
+     * replace top-level fields larger than threshold by references (see store_blob).
+     */
+    mongo::BSONObj offload_fields(mongo::GridFS& fs, mongo::DBClientConnection& con, const std::string& fscol,
+            const mongo::BSONObj& obj, const mongo::BSONElement& taskid, size_t threshold);
+
+    /**
+     * true if e is a reference created by store_blob.
+     */
+    bool is_blob_ref(const mongo::BSONElement& e);
+
+    /**
+     * load a value stored with store_blob.
+     *
+     * @return a document with the value as its only field, named name
+     */
+    mongo::BSONObj fetch_blob(mongo::GridFS& fs, const mongo::BSONObj& ref, const std::string& name);
+
+    /**
+     * write the raw bytes of a value stored with store_blob, chunk by chunk.
+     */
+    void stream_blob(mongo::GridFS& fs, const mongo::BSONObj& ref, std::ostream& os);
+}
+#endif /* __MDBQ_BLOB_HPP__ */
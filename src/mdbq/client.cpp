@@ -1,13 +1,21 @@
-#include <boost/format.hpp>
+#include <cstdio>
+#include <map>
+#include <list>
+#include <algorithm>
 #include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/uuid/random_generator.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/recursive_mutex.hpp>
 #include <mongo/client/dbclient.h>
 #include <mongo/client/gridfs.h>
 #include "client.hpp"
 #include "common.hpp"
 #include "date_time.hpp"
+#include "io_thread.hpp"
+#include "blob.hpp"
+#include "spool.hpp"
 
 #ifdef NDEBUG
 #  define CHECK_DB_ERR(CON)
@@ -23,22 +31,968 @@
 
 namespace mdbq
 {
+    /// like capture_exception(), but keeps timeout_exception and cancelled_exception intact
+    boost::exception_ptr capture_client_exception(){
+        try{
+            throw;
+        }catch(timeout_exception& e){
+            return boost::copy_exception(e);
+        }catch(cancelled_exception& e){
+            return boost::copy_exception(e);
+        }catch(...){
+            return capture_exception();
+        }
+    }
+
+    /**
+     * "hostname:pid", identifies a client as owner of tasks.
+     *
+     * further clients of the process get "hostname:pid/n", so that they
+     * can tell each other's tasks apart, e.g. for speculative execution.
+     */
+    std::string worker_identity(){
+        static boost::mutex mutex;
+        static unsigned int n_clients = 0;
+        unsigned int n;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            n = n_clients++;
+        }
+        char hostname[256] = {0};
+        gethostname(hostname, sizeof(hostname)-1);
+        char buf[sizeof(hostname) + 48];
+        if(n)
+            snprintf(buf, sizeof(buf), "%s:%d/%u", hostname, (int)getpid(), n);
+        else
+            snprintf(buf, sizeof(buf), "%s:%d", hostname, (int)getpid());
+        return buf;
+    }
 
     struct ClientImpl{
         mongo::DBClientConnection m_con;
+        std::string               m_url;
+        std::string               m_db;
+        mongo::BSONObj            m_claim_result;   ///< owns the buffer m_current_task points into
         mongo::BSONObj            m_current_task;
+        mongo::BSONElement        m_current_id;     ///< _id of m_current_task
         mongo::BSONObj            m_task_selector;
-        std::auto_ptr<mongo::GridFS>             m_fs;
+        mongo::BSONObj            m_claim_query;    ///< state==TS_NEW plus m_task_selector
+        mongo::BSONObj            m_claim_fields;   ///< projection of claimed tasks, empty for all
+        std::string               m_owner;
+        int                       m_cmd_size;       ///< size of the last claim command, to size the next one
+        boost::scoped_ptr<mongo::GridFS>           m_fs;
+        boost::uuids::basic_random_generator<boost::mt19937> m_uuid_gen;
         boost::posix_time::ptime  m_current_task_timeout_time;
         long long int             m_running_nr;
-        //std::auto_ptr<mongo::BSONArrayBuilder>   m_log;
         std::vector<mongo::BSONObj> m_log;
+
+        /// points of one metric which were not written yet
+        struct MetricBuffer{
+            std::vector<long long> steps;
+            std::vector<double>    values;
+        };
+        std::map<std::string, MetricBuffer> m_metrics;
+
+        /// an interval of a downsampled curve
+        struct MetricBin{
+            double n, sum, step; ///< number of points, sum of values, sum of steps
+            MetricBin() : n(0), sum(0), step(0){}
+        };
+        bool                      m_cancelled; ///< the last task was cancelled by the hub
+        bool                      m_fair_share;
+        boost::shared_ptr<ResourcePool> m_pool;
+        double                    m_spec_percentile;  ///< speculative execution, 0 if disabled
+        unsigned int              m_spec_min_peers;
+        double                    m_spec_threshold;   ///< straggler runtime in seconds, <0 if unknown
+        boost::posix_time::ptime  m_spec_next_update;
+        bool                      m_speculative;      ///< the current task is a duplicate attempt
+        std::string               m_state;            ///< saved by the handler, written at the next checkpoint
+        bool                      m_state_dirty;
+        std::string               m_state_file;       ///< GridFS file holding the task's saved state, if any
+        std::vector<std::pair<mongo::BSONObj, std::string> > m_stale_state_files; ///< _id of the task and a state file it may not need anymore
+        unsigned int              m_affinity_wait;    ///< affinity routing, 0 if disabled
+        unsigned int              m_n_warm;           ///< number of recent affinity keys considered warm
+        std::list<std::string>    m_recent_keys;      ///< affinity keys of recent tasks, most recent first
+        std::vector<std::string>  m_warm_keys;        ///< set by the user
+        boost::posix_time::ptime  m_idle_since;       ///< first claim which found no preferred task
+        boost::posix_time::ptime  m_warm_refresh;     ///< when to advertise our warm keys again
+        mongo::BSONObj            m_others_warm;      ///< warm keys of other clients, cached
+        boost::posix_time::ptime  m_others_refresh;   ///< when to query m_others_warm again
+        WriteConcern              m_write_concern[WO_N_OPS];
+
+        /// a result queued for group commit
+        struct PendingFinish{
+            mongo::BSONObj query;   ///< _id and version guard
+            mongo::BSONObj update;
+            int            version;
+            boost::posix_time::ptime flush_by; ///< commit at the latest at this time
+        };
+        std::vector<PendingFinish> m_pending;
+        boost::scoped_ptr<Spool>   m_spool;  ///< writes which did not reach the server yet
+        unsigned int               m_group_commit;
+        unsigned int               m_group_delay;   ///< maximum time in seconds a result stays queued
+        finish_error_handler       m_on_finish_error;
         float              m_interval;
-        std::auto_ptr<boost::asio::deadline_timer> m_timer;
+        boost::scoped_ptr<boost::asio::deadline_timer> m_timer;
+
+        /// serializes access to m_con and the task state once the I/O thread runs
+        boost::recursive_mutex    m_mutex;
+        boost::asio::io_service*  m_executor;
+        bool                      m_busy;
+        IoThread                  m_io; // declared last: joined before the rest is destroyed
+
+        ClientImpl()
+            : m_owner(worker_identity())
+            , m_cmd_size(256)
+            , m_cancelled(false)
+            , m_fair_share(false)
+            , m_spec_percentile(0)
+            , m_spec_min_peers(10)
+            , m_spec_threshold(-1)
+            , m_spec_next_update(boost::posix_time::neg_infin)
+            , m_speculative(false)
+            , m_state_dirty(false)
+            , m_affinity_wait(0)
+            , m_n_warm(4)
+            , m_idle_since(boost::posix_time::pos_infin)
+            , m_warm_refresh(boost::posix_time::neg_infin)
+            , m_others_refresh(boost::posix_time::neg_infin)
+            , m_group_commit(0)
+            , m_group_delay(30)
+            , m_executor(NULL)
+            , m_busy(false)
+        {
+            for(int i = 0; i < WO_N_OPS; i++)
+                m_write_concern[i] = WC_ACKNOWLEDGED;
+        }
+
+        /**
+         * wait for the last write as configured for op, throw if it failed.
+         *
+         * @return number of documents matched, -1 if the write is not acknowledged
+         */
+        int check_write(WriteOp op){
+            WriteConcern wc = m_write_concern[op];
+            if(wc == WC_UNACKNOWLEDGED)
+                return -1;
+            mongo::BSONObj err = m_con.getLastErrorDetailed(false, wc == WC_JOURNALED, 1);
+            if(!err["ok"].trueValue())
+                throw std::runtime_error("MDBQC: write failed: " + err["errmsg"].str());
+            if(err["err"].type() == mongo::String)
+                throw std::runtime_error("MDBQC: write failed: " + err["err"].str());
+            return err["n"].numberInt();
+        }
+
+        /// run a findAndModify, wait for it as configured for op, throw if it failed
+        void find_and_modify(const mongo::BSONObj& cmd, mongo::BSONObj& res, WriteOp op){
+            if(!m_con.runCommand(m_db, cmd, res) && res["errmsg"].str() != "No matching object found")
+                throw std::runtime_error("MDBQC: findAndModify failed: " + res["errmsg"].str());
+            check_write(op);
+        }
+
+        void flush_log(const std::string& logcol){
+            if(m_log.empty())
+                return;
+            std::vector<mongo::BSONObj> log;
+            log.swap(m_log);
+            try{
+                spooled_insert(logcol, log, WO_LOG);
+            }catch(...){
+                // keep the entries for the next attempt
+                m_log.insert(m_log.begin(), log.begin(), log.end());
+                throw;
+            }
+        }
+
+        /**
+         * apply a spool record.
+         *
+         * records are idempotent: inserted documents carry their _id,
+         * so a repeated insert fails with a duplicate key, and updates
+         * are guarded by the version or state of the task.
+         *
+         * @return the error reported by the server, empty on success
+         * @throw if the server cannot be reached
+         */
+        std::string apply_record(const mongo::BSONObj& rec){
+            std::string ns = rec["ns"].String();
+            if(rec["op"].String() == "insert"){
+                std::vector<mongo::BSONElement> d = rec["docs"].Array();
+                std::vector<mongo::BSONObj> docs;
+                docs.reserve(d.size());
+                for(unsigned int i = 0; i < d.size(); i++)
+                    docs.push_back(d[i].Obj());
+                m_con.insert(ns, docs, mongo::InsertOption_ContinueOnError);
+            }else{
+                m_con.update(ns, rec["q"].Obj(), rec["u"].Obj(), rec["upsert"].trueValue());
+            }
+            mongo::BSONObj err = m_con.getLastErrorDetailed(false, rec["j"].trueValue(), 1);
+            // 11000 is a duplicate key, i.e. written by an earlier attempt
+            if(err["err"].isNull() || err["code"].numberInt() == 11000)
+                return "";
+            return err["err"].str();
+        }
+
+        /// connect again after an outage, false if the server is still unreachable
+        bool reconnect(){
+            if(!m_con.isFailed())
+                return true;
+            try{
+                m_con.connect(m_url);
+            }catch(std::exception&){
+                return false;
+            }
+            return true;
+        }
+
+        /// replay the spool in order, false if the server is still unreachable
+        bool drain_spool(){
+            if(!reconnect())
+                return m_spool->empty();
+            while(!m_spool->empty()){
+                mongo::BSONObj rec = m_spool->front();
+                try{
+                    std::string err = apply_record(rec);
+                    if(!err.empty())
+                        std::cerr << "MDBQC: WARNING: dropping spooled write: " << err << std::endl;
+                }catch(std::exception& e){
+                    return false;
+                }
+                m_spool->pop();
+            }
+            return true;
+        }
+
+        /**
+         * write through the spool.
+         *
+         * the record is sent directly unless older records wait in the
+         * spool or the server is unreachable.
+         *
+         * @throw if the spool is full, we do not wait for the server
+         *        while holding the client's mutex
+         */
+        void spool_write(const mongo::BSONObj& rec){
+            if(drain_spool()){
+                bool sent = false;
+                std::string err;
+                try{
+                    err  = apply_record(rec);
+                    sent = true;
+                }catch(std::exception& e){
+                    std::cerr << "MDBQC: WARNING: server unreachable, spooling: " << e.what() << std::endl;
+                }
+                if(sent){
+                    if(!err.empty())
+                        throw std::runtime_error("MDBQC: write failed: " + err);
+                    return;
+                }
+            }
+            if((size_t)rec.objsize() > m_spool->capacity())
+                throw std::runtime_error("MDBQC: write is larger than the spool");
+            if(!m_spool->append(rec))
+                throw std::runtime_error("MDBQC: spool is full, server unreachable");
+        }
+
+        void spooled_insert(const std::string& ns, const std::vector<mongo::BSONObj>& docs, WriteOp op){
+            if(!m_spool){
+                m_con.insert(ns, docs);
+                check_write(op);
+                return;
+            }
+            mongo::BSONArrayBuilder arr;
+            for(unsigned int i = 0; i < docs.size(); i++)
+                arr.append(docs[i]);
+            spool_write(BSON("op" << "insert" << "ns" << ns << "docs" << arr.arr() <<
+                        "j" << (m_write_concern[op] == WC_JOURNALED)));
+        }
+
+        /// @return number of documents matched, -1 if unknown (spooled or not acknowledged)
+        int spooled_update(const std::string& ns, const mongo::BSONObj& q, const mongo::BSONObj& u, WriteOp op){
+            if(!m_spool){
+                m_con.update(ns, q, u);
+                return check_write(op);
+            }
+            spool_write(BSON("op" << "update" << "ns" << ns << "q" << q << "u" << u <<
+                        "j" << (m_write_concern[op] == WC_JOURNALED)));
+            return -1;
+        }
+
+        /**
+         * write buffered metrics as bucket documents.
+         *
+         * steps and values are stored as little arrays of int64 and double
+         * in BinData, together with a summary used for downsampling.
+         */
+        void flush_metrics(){
+            static const size_t bucket_size = 1000;
+            if(m_metrics.empty())
+                return;
+            std::vector<mongo::BSONObj> buckets;
+            for(std::map<std::string, MetricBuffer>::const_iterator it = m_metrics.begin();
+                    it != m_metrics.end(); ++it){
+                const MetricBuffer& mb = it->second;
+                for(size_t b = 0; b < mb.steps.size(); b += bucket_size){
+                    size_t n = std::min(bucket_size, mb.steps.size() - b);
+                    double vmin = mb.values[b], vmax = mb.values[b], sum = 0;
+                    for(size_t i = b; i < b + n; i++){
+                        vmin = std::min(vmin, mb.values[i]);
+                        vmax = std::max(vmax, mb.values[i]);
+                        sum += mb.values[i];
+                    }
+                    mongo::BSONObjBuilder bob(128 + n * 16);
+                    bob.genOID();
+                    bob.appendAs(m_current_id, "taskid");
+                    bob.append("name", it->first);
+                    bob.append("n", (int)n);
+                    bob.append("first", *std::min_element(&mb.steps[b], &mb.steps[b] + n));
+                    bob.append("last",  *std::max_element(&mb.steps[b], &mb.steps[b] + n));
+                    bob.append("min", vmin);
+                    bob.append("max", vmax);
+                    bob.append("sum", sum);
+                    bob.appendBinData("steps",  n * sizeof(long long), mongo::BinDataGeneral, (const char*)&mb.steps[b]);
+                    bob.appendBinData("values", n * sizeof(double),    mongo::BinDataGeneral, (const char*)&mb.values[b]);
+                    buckets.push_back(bob.obj());
+                }
+            }
+            if(!m_spool)
+                // cached by the driver after the first call
+                m_con.ensureIndex(m_db+".metrics", BSON("taskid"<<1 << "name"<<1 << "first"<<1));
+            spooled_insert(m_db+".metrics", buckets, WO_LOG);
+            m_metrics.clear(); // kept for the next attempt if the write failed
+        }
+
+        mongo::BSONObj aggregate_metrics(const mongo::BSONArray& pipeline){
+            mongo::BSONObj res;
+            if(!m_con.runCommand(m_db, BSON("aggregate" << "metrics" << "pipeline" << pipeline), res))
+                throw std::runtime_error("MDBQC: metric aggregation failed: " + res.toString());
+            return res;
+        }
+
+        /// add the points in [from, to] of the buckets matching q to intervals of width starting at lo
+        void bin_points(const mongo::Query& q, long long from, long long to, long long lo, double width,
+                std::map<long long, MetricBin>& bins){
+            std::auto_ptr<mongo::DBClientCursor> p = m_con.query(m_db+".metrics", q);
+            CHECK_DB_ERR(m_con);
+            while(p->more()){
+                mongo::BSONObj f = p->next();
+                int len;
+                const long long* s = (const long long*)f["steps"].binData(len);
+                const double*    v = (const double*)f["values"].binData(len);
+                int n = f["n"].numberInt();
+                for(int i = 0; i < n; i++){
+                    if(s[i] < from || s[i] > to)
+                        continue;
+                    MetricBin& b = bins[(long long)((s[i] - lo) / width)];
+                    b.n    += 1;
+                    b.sum  += v[i];
+                    b.step += s[i];
+                }
+            }
+        }
+
+        /// write all queued results in one bulk update, report errors per task
+        unsigned int flush_finished(){
+            if(m_pending.empty())
+                return 0;
+            std::vector<PendingFinish> pending;
+            pending.swap(m_pending);
+
+            WriteConcern wc = m_write_concern[WO_FINISH];
+            mongo::BSONObjBuilder wcb;
+            wcb.append("w", wc == WC_UNACKNOWLEDGED ? 0 : 1);
+            if(wc == WC_JOURNALED)
+                wcb.append("j", true);
+
+            mongo::BSONArrayBuilder updates;
+            for(unsigned int i = 0; i < pending.size(); i++)
+                updates.append(BSON("q" << pending[i].query << "u" << pending[i].update));
+
+            mongo::BSONObj res;
+            std::vector<std::string> errors(pending.size());
+            bool ok = m_con.runCommand(m_db, BSON(
+                        "update"       << "jobs" <<
+                        "updates"      << updates.arr() <<
+                        "ordered"      << false <<
+                        "writeConcern" << wcb.obj()), res);
+            if(!ok){
+                for(unsigned int i = 0; i < pending.size(); i++)
+                    errors[i] = "group commit failed: " + res["errmsg"].str();
+            }else if(wc != WC_UNACKNOWLEDGED){
+                if(res.hasField("writeErrors")){
+                    std::vector<mongo::BSONElement> we = res["writeErrors"].Array();
+                    for(unsigned int i = 0; i < we.size(); i++){
+                        unsigned int idx = we[i].Obj()["index"].numberInt();
+                        if(idx < errors.size())
+                            errors[idx] = we[i].Obj()["errmsg"].str();
+                    }
+                }
+                // the command only reports how many updates matched in total.
+                // If some did not, find the ones which lost the version guard.
+                if(res["n"].numberInt() < (int)pending.size()){
+                    mongo::BSONArrayBuilder ids;
+                    for(unsigned int i = 0; i < pending.size(); i++)
+                        ids.append(pending[i].query["_id"]);
+                    mongo::BSONObj fields = BSON("version" << 1 << "state" << 1);
+                    std::auto_ptr<mongo::DBClientCursor> p = m_con.query(m_db+".jobs",
+                            BSON("_id" << BSON("$in" << ids.arr())), 0, 0, &fields);
+                    std::map<std::string, mongo::BSONObj> current;
+                    while(p->more()){
+                        mongo::BSONObj f = p->next().getOwned();
+                        current[f["_id"].toString(false)] = f;
+                    }
+                    for(unsigned int i = 0; i < pending.size(); i++){
+                        if(!errors[i].empty())
+                            continue;
+                        std::map<std::string, mongo::BSONObj>::iterator it = current.find(pending[i].query["_id"].toString(false));
+                        if(it == current.end())
+                            errors[i] = "task was removed";
+                        else if(it->second["state"].numberInt() == TS_OK)
+                            ; // finished, by us or by another attempt of the task
+                        else if(it->second["version"].numberInt() != pending[i].version + 1)
+                            errors[i] = "task was rescheduled or finished by someone else";
+                    }
+                }
+            }
+
+            unsigned int n_ok = 0, n_failed = 0;
+            for(unsigned int i = 0; i < pending.size(); i++){
+                if(errors[i].empty()){
+                    n_ok++;
+                    continue;
+                }
+                n_failed++;
+                if(m_on_finish_error)
+                    m_on_finish_error(pending[i].query["_id"].wrap(), errors[i]);
+            }
+            collect_state_files();
+            if(n_failed && !m_on_finish_error)
+                throw std::runtime_error("MDBQC: group commit: "
+                        + boost::lexical_cast<std::string>(n_failed) + " results not committed, first error: "
+                        + *std::find_if(errors.begin(), errors.end(), is_nonempty));
+            return n_ok;
+        }
+        static bool is_nonempty(const std::string& s){ return !s.empty(); }
+
+        /// commit queued results which should not wait any longer, e.g. on a busy worker
+        void flush_due(const boost::posix_time::ptime& now){
+            for(unsigned int i = 0; i < m_pending.size(); i++){
+                if(now >= m_pending[i].flush_by){
+                    flush_finished();
+                    return;
+                }
+            }
+        }
+
+        void init(const std::string& url, const std::string& db, const mongo::BSONObj& query){
+            m_url = url;
+            m_db = db;
+            m_con.connect(url);
+            CHECK_DB_ERR(m_con);
+            m_task_selector = query.getOwned();
+
+            mongo::BSONObjBuilder queryb;
+            queryb.append("state", TS_NEW);
+            if(! m_task_selector.isEmpty())
+                queryb.appendElements(m_task_selector);
+            m_claim_query = queryb.obj();
+
+            m_fs.reset(new mongo::GridFS(m_con, db, "fs"));
+        }
+
+        /**
+         * the query for claimable tasks.
+         *
+         * with a resource pool, every requirement of the task must be
+         * available, and the task must not require anything unknown.
+         * Must be called with the pool locked.
+         */
+        mongo::BSONObj claim_query()const{
+            if(!m_pool)
+                return m_claim_query;
+            mongo::BSONObjBuilder queryb;
+            queryb.appendElements(m_claim_query);
+            mongo::BSONArrayBuilder fits, keys;
+            std::map<std::string, double>::const_iterator it;
+            for(it = m_pool->m_available.begin(); it != m_pool->m_available.end(); ++it){
+                std::string field = "resources." + it->first;
+                fits.append(BSON("$or" << BSON_ARRAY(
+                                BSON(field << BSON("$exists" << false)) <<
+                                BSON(field << mongo::LTE << it->second))));
+                keys.append(it->first);
+            }
+            if(fits.arrSize())
+                queryb.append("$and", fits.arr());
+            queryb.append("resource_keys", BSON("$not" << BSON("$elemMatch" << BSON("$nin" << keys.arr()))));
+            return queryb.obj();
+        }
+
+        /// claim a task, taking fair share and resources into account
+        bool claim_next(const boost::posix_time::ptime& now){
+            if(!m_pool)
+                return claim_affine(m_claim_query, now);
+
+            bool claimed;
+            {
+                // hold the pool while claiming, so that clients sharing it do not overcommit
+                boost::mutex::scoped_lock lock(m_pool->m_mutex);
+                claimed = claim_affine(claim_query(), now);
+                if(claimed && m_current_task.hasField("resources"))
+                    m_pool->reserve_locked(m_current_task["resources"].Obj());
+            }
+            if(claimed)
+                advertise_resources();
+            return claimed;
+        }
+
+        /// advertise the resources of this process
+        void advertise_resources(){
+            m_con.update(m_db+".workers",
+                    QUERY("_id" << m_owner),
+                    BSON("$set" << BSON(
+                            "capacity"     << m_pool->capacity() <<
+                            "available"    << m_pool->available() <<
+                            "refresh_time" << to_mongo_date(universal_date_time()))),
+                    true);
+        }
+
+        /**
+         * atomically book a task matching query.
+         *
+         * on success, m_current_task refers into m_claim_result, no copy
+         * is made. It is only valid until clear_task().
+         */
+        bool claim(const mongo::BSONObj& query, const boost::posix_time::ptime& now){
+            mongo::Date_t now_d = to_mongo_date(now);
+            mongo::BSONObjBuilder cmdb(m_cmd_size);
+            cmdb.append("findAndModify", "jobs");
+            cmdb.append("query", query);
+            if(!m_claim_fields.isEmpty())
+                cmdb.append("fields", m_claim_fields);
+            {
+                mongo::BSONObjBuilder updateb(cmdb.subobjStart("update"));
+                mongo::BSONObjBuilder setb(updateb.subobjStart("$set"));
+                setb.appendDate("book_time", now_d);
+                setb.append("state", TS_RUNNING);
+                setb.append("result.status", "running");
+                setb.appendDate("refresh_time", now_d);
+                setb.append("owner", m_owner);
+                setb.done();
+                updateb.done();
+            }
+            mongo::BSONObj cmd = cmdb.done();
+            m_cmd_size = cmd.objsize();
+
+            find_and_modify(cmd, m_claim_result, WO_STATUS);
+            mongo::BSONElement value = m_claim_result["value"];
+            if(!value.isABSONObj())
+                return false;
+            m_current_task = value.Obj();
+            m_current_id   = m_current_task["_id"];
+            m_speculative  = false;
+            return true;
+        }
+
+        bool claim_any(const mongo::BSONObj& query, const boost::posix_time::ptime& now){
+            return m_fair_share
+                ? claim_fair(query, now)
+                : claim(query, now);
+        }
+
+        /// the affinity keys we have warm
+        mongo::BSONArray warm_keys()const{
+            mongo::BSONArrayBuilder arr;
+            for(unsigned int i = 0; i < m_warm_keys.size(); i++)
+                arr.append(m_warm_keys[i]);
+            for(std::list<std::string>::const_iterator it = m_recent_keys.begin(); it != m_recent_keys.end(); ++it)
+                arr.append(*it);
+            return arr.arr();
+        }
+
+        /**
+         * how often warm keys are advertised and looked up.
+         *
+         * a few times per m_affinity_wait, so that a busy client stays
+         * among the recently active ones while it checkpoints.
+         */
+        boost::posix_time::time_duration affinity_refresh()const{
+            return boost::posix_time::seconds(std::max(1u, m_affinity_wait / 3));
+        }
+
+        void advertise_warm_keys(const boost::posix_time::ptime& now){
+            m_con.update(m_db+".workers",
+                    QUERY("_id" << m_owner),
+                    BSON("$set" << BSON(
+                            "warm"         << warm_keys() <<
+                            "refresh_time" << to_mongo_date(now))),
+                    true);
+            m_warm_refresh = now + affinity_refresh();
+        }
+
+        /// the warm keys of the other recently active clients
+        mongo::BSONArray others_warm_keys(const boost::posix_time::ptime& now){
+            if(now >= m_others_refresh){
+                mongo::BSONObj res;
+                m_con.runCommand(m_db, BSON("distinct" << "workers" << "key" << "warm" << "query" << BSON(
+                                "_id" << BSON("$ne" << m_owner) <<
+                                "refresh_time" << BSON("$gt" << to_mongo_date(now - boost::posix_time::seconds(m_affinity_wait))))), res);
+                m_others_warm = res["values"].isABSONObj() ? res["values"].Obj().getOwned() : mongo::BSONObj();
+                m_others_refresh = now + affinity_refresh();
+            }
+            return mongo::BSONArray(m_others_warm);
+        }
+
+        /**
+         * claim a task, preferring tasks whose affinity we have warm.
+         *
+         * in order of preference:
+         * - tasks with a warm affinity key,
+         * - tasks without affinity, with an affinity no other recently
+         *   active client has warm, or waiting for longer than m_affinity_wait,
+         * - any task, once we have been looking for m_affinity_wait seconds.
+         */
+        bool claim_affine(const mongo::BSONObj& base, const boost::posix_time::ptime& now){
+            if(!m_affinity_wait)
+                return claim_any(base, now);
+
+            mongo::BSONArray warm = warm_keys();
+            bool claimed = warm.nFields() && claim_any(BSON("$and" << BSON_ARRAY(base <<
+                            BSON("affinity" << BSON("$in" << warm)))), now);
+            if(!claimed){
+                mongo::Date_t cutoff = to_mongo_date(now - boost::posix_time::seconds(m_affinity_wait));
+                mongo::BSONArray others = others_warm_keys(now);
+                claimed = claim_any(BSON("$and" << BSON_ARRAY(base << BSON("$or" << BSON_ARRAY(
+                                    BSON("affinity" << BSON("$nin" << others)) <<
+                                    BSON("create_time" << BSON("$lt" << cutoff)))))), now);
+            }
+            if(!claimed){
+                if(m_idle_since == boost::posix_time::pos_infin)
+                    m_idle_since = now;
+                if(now - m_idle_since < boost::posix_time::seconds(m_affinity_wait))
+                    return false;
+                claimed = claim_any(base, now);
+            }
+            if(!claimed)
+                return false;
+            m_idle_since = boost::posix_time::pos_infin;
+
+            mongo::BSONElement key = m_current_task["affinity"];
+            bool changed = false;
+            if(key.type() == mongo::String && (m_recent_keys.empty() || m_recent_keys.front() != key.String())){
+                m_recent_keys.remove(key.String());
+                m_recent_keys.push_front(key.String());
+                if(m_recent_keys.size() > m_n_warm)
+                    m_recent_keys.pop_back();
+                changed = true;
+            }
+            if(changed || now >= m_warm_refresh)
+                advertise_warm_keys(now);
+            return true;
+        }
+
+        /**
+         * run time above which a task counts as a straggler.
+         *
+         * the given percentile of the run times of recently finished
+         * tasks, recomputed at most every 30 seconds.
+         *
+         * @return seconds, negative if there are too few finished tasks
+         */
+        double straggler_threshold(const boost::posix_time::ptime& now){
+            if(now < m_spec_next_update)
+                return m_spec_threshold;
+            m_spec_next_update = now + boost::posix_time::seconds(30);
+
+            mongo::BSONObjBuilder qb;
+            qb.append("state", TS_OK);
+            qb.appendElements(m_task_selector);
+            mongo::BSONObj fields = BSON("book_time" << 1 << "finish_time" << 1);
+            std::auto_ptr<mongo::DBClientCursor> p = m_con.query(m_db+".jobs",
+                    mongo::Query(qb.obj()).sort("finish_time", -1), 100, 0, &fields);
+            CHECK_DB_ERR(m_con);
+            std::vector<double> runtimes;
+            while(p->more()){
+                mongo::BSONObj f = p->next();
+                if(f["book_time"].type() == mongo::Date && f["finish_time"].type() == mongo::Date)
+                    runtimes.push_back(((long long)f["finish_time"].Date() - (long long)f["book_time"].Date()) / 1000.);
+            }
+            if(runtimes.size() < m_spec_min_peers || runtimes.empty()){
+                m_spec_threshold = -1;
+                return m_spec_threshold;
+            }
+            size_t i = std::min(runtimes.size() - 1, (size_t)(m_spec_percentile * runtimes.size()));
+            std::nth_element(runtimes.begin(), runtimes.begin() + i, runtimes.end());
+            m_spec_threshold = runtimes[i];
+            return m_spec_threshold;
+        }
+
+        /**
+         * claim a duplicate attempt of the oldest straggler.
+         *
+         * the task stays with its owner, we only mark it with spec_owner,
+         * so that there is at most one duplicate. Whoever finishes first
+         * wins through the version guard of finish(), the other one
+         * notices at its next checkpoint.
+         */
+        bool claim_speculative(const boost::posix_time::ptime& now){
+            double threshold = straggler_threshold(now);
+            if(threshold < 0)
+                return false;
+            mongo::Date_t now_d = to_mongo_date(now);
+            mongo::BSONObjBuilder cmdb(m_cmd_size);
+            cmdb.append("findAndModify", "jobs");
+            {
+                mongo::BSONObjBuilder queryb(cmdb.subobjStart("query"));
+                queryb.appendElements(m_task_selector);
+                queryb.append("state", TS_RUNNING);
+                {
+                    mongo::BSONObjBuilder ltb(queryb.subobjStart("book_time"));
+                    ltb.appendDate("$lt", to_mongo_date(now - boost::posix_time::millisec((long)(threshold * 1000))));
+                    ltb.done();
+                }
+                queryb.append("spec_owner", BSON("$exists" << false));
+                queryb.append("owner", BSON("$ne" << m_owner));
+                if(m_pool)
+                    // we cannot reserve what the original attempt holds
+                    queryb.append("resources", BSON("$exists" << false));
+                queryb.done();
+            }
+            cmdb.append("sort", BSON("book_time" << 1));
+            if(!m_claim_fields.isEmpty())
+                cmdb.append("fields", m_claim_fields);
+            {
+                mongo::BSONObjBuilder updateb(cmdb.subobjStart("update"));
+                mongo::BSONObjBuilder setb(updateb.subobjStart("$set"));
+                setb.append("spec_owner", m_owner);
+                setb.appendDate("spec_time", now_d);
+                setb.done();
+                updateb.done();
+            }
+            find_and_modify(cmdb.done(), m_claim_result, WO_STATUS);
+            mongo::BSONElement value = m_claim_result["value"];
+            if(!value.isABSONObj())
+                return false;
+            m_current_task = value.Obj();
+            m_current_id   = m_current_task["_id"];
+            m_speculative  = true;
+            return true;
+        }
+
+        /**
+         * the saved_state field for the pending state.
+         *
+         * small states are stored inline, large ones in a new GridFS
+         * file, so that the previous state stays intact until the
+         * task refers to the new one.
+         */
+        mongo::BSONObj make_state(){
+            static const size_t inline_limit = 64*1024;
+            mongo::BSONObjBuilder bob(64 + std::min(m_state.size(), inline_limit));
+            bob.appendBinData("saved_state", m_state.size(), mongo::BinDataGeneral, m_state.data());
+            mongo::BSONObj state = bob.obj();
+            if(m_state.size() <= inline_limit)
+                return state;
+            std::string filename = "state:" + m_current_id.toString(false) + ":" + mongo::OID::gen().str();
+            return BSON("saved_state" << store_blob(*m_fs, m_con, m_db+".fs",
+                        state.firstElement(), filename, m_current_id));
+        }
+
+        /// the GridFS file of a saved_state field, empty if stored inline
+        static std::string state_file(const mongo::BSONObj& state){
+            mongo::BSONElement e = state["saved_state"];
+            return is_blob_ref(e) ? e.Obj()["mdbq_blob"].String() : "";
+        }
+
+        /// remember that the current task may not need a state file anymore
+        void release_state_file(const std::string& file){
+            if(!file.empty())
+                m_stale_state_files.push_back(std::make_pair(m_current_id.wrap(), file));
+        }
+
+        /**
+         * remove released state files which their task does not refer to.
+         *
+         * only once all writes of this client have landed, so that a
+         * queued write cannot refer to them anymore. A file which is
+         * still referred to belongs to the next attempt of a rescheduled
+         * task and is left alone.
+         */
+        void collect_state_files(){
+            if(m_stale_state_files.empty() || !m_pending.empty() || (m_spool && !m_spool->empty()))
+                return;
+            try{
+                while(!m_stale_state_files.empty()){
+                    const std::pair<mongo::BSONObj, std::string>& f = m_stale_state_files.back();
+                    mongo::BSONObjBuilder qb;
+                    qb.appendElements(f.first);
+                    qb.append("saved_state.mdbq_blob", f.second);
+                    if(!m_con.count(m_db+".jobs", qb.obj()))
+                        m_fs->removeFile(f.second);
+                    m_stale_state_files.pop_back();
+                }
+            }catch(std::exception& e){
+                // retried after the next write
+                std::cerr << "MDBQC: WARNING: cannot remove state file: " << e.what() << std::endl;
+            }
+        }
+
+        /**
+         * pass a timed out task to its speculative duplicate, if there is one.
+         *
+         * the duplicate keeps running instead of being cancelled, and
+         * continues with the book time of its own claim.
+         *
+         * @return true if the duplicate owns the task now
+         */
+        bool hand_over(){
+            try{
+                mongo::BSONObj fields = BSON("spec_owner" << 1 << "spec_time" << 1);
+                mongo::BSONObj cur = m_con.findOne(m_db+".jobs",
+                        QUERY(m_current_id << "owner" << m_owner << "state" << TS_RUNNING <<
+                            "spec_owner" << BSON("$exists" << true)), &fields);
+                if(cur.isEmpty())
+                    return false;
+                m_con.update(m_db+".jobs",
+                        QUERY(m_current_id << "owner" << m_owner << "spec_owner" << cur["spec_owner"]),
+                        BSON("$set" << BSON("owner" << cur["spec_owner"] << "book_time" << cur["spec_time"]) <<
+                             "$unset" << BSON("spec_owner" << 1)));
+                return m_con.getLastErrorDetailed()["n"].numberInt() == 1;
+            }catch(std::exception&){
+                // the failure goes to the spool, the duplicate notices at its next checkpoint
+                if(!m_spool)
+                    throw;
+                return false;
+            }
+        }
+
+        /// give up a duplicate attempt without touching the original one
+        void drop_speculative(){
+            spooled_update(m_db+".jobs",
+                    BSON(m_current_id << "spec_owner" << m_owner),
+                    BSON("$unset" << BSON("spec_owner" << 1)),
+                    WO_STATUS);
+        }
+
+        /**
+         * claim a task of the experiment which is furthest behind its share.
+         *
+         * this is stride scheduling: every claim advances the pass of the
+         * experiment by 1/weight, and the experiment with the smallest
+         * pass is served first. Experiments with pending jobs are tried
+         * in order of their pass until one has a job for us.
+         */
+        bool claim_fair(const mongo::BSONObj& base, const boost::posix_time::ptime& now){
+            mongo::BSONObj fields = BSON("weight" << 1 << "cap" << 1 << "running" << 1);
+            std::auto_ptr<mongo::DBClientCursor> p = m_con.query(m_db+".experiments",
+                    mongo::Query(BSON("open" << mongo::GT << 0)).sort("pass"), 0, 0, &fields, 0, 8);
+            CHECK_DB_ERR(m_con);
+            while(p->more()){
+                mongo::BSONObj e = p->next().getOwned();
+                int cap = e["cap"].numberInt();
+                if(cap > 0){
+                    if(e["running"].numberInt() >= cap)
+                        continue;
+                    // reserve a slot before claiming, so that concurrent clients cannot exceed the cap
+                    m_con.update(m_db+".experiments",
+                            BSON(e["_id"] << "cap" << cap << "running" << BSON("$lt" << cap)),
+                            BSON("$inc" << BSON("running" << 1)));
+                    if(m_con.getLastErrorDetailed()["n"].numberInt() == 0)
+                        continue;
+                }
+                mongo::BSONObjBuilder queryb;
+                queryb.appendElements(base);
+                queryb.appendAs(e["_id"], "exp_key");
+                if(!claim(queryb.obj(), now)){
+                    if(cap > 0)
+                        m_con.update(m_db+".experiments",
+                                QUERY(e["_id"]),
+                                BSON("$inc" << BSON("running" << -1)));
+                    continue;
+                }
+                double weight = e["weight"].isNumber() ? e["weight"].Number() : 1.;
+                m_con.update(m_db+".experiments",
+                        QUERY(e["_id"]),
+                        BSON("$inc" << (cap > 0
+                                ? BSON("open" << -1 << "pass" << 1./weight)
+                                : BSON("running" << 1 << "open" << -1 << "pass" << 1./weight))));
+                return true;
+            }
+
+            // jobs without bookkeeping, e.g. inserted by a third party, or
+            // whose open counter drifted until the hub reconciles it.
+            // Capped experiments are only claimed with a reserved slot.
+            mongo::BSONArrayBuilder capped;
+            mongo::BSONObj idonly = BSON("_id" << 1);
+            std::auto_ptr<mongo::DBClientCursor> c = m_con.query(m_db+".experiments",
+                    BSON("cap" << mongo::GT << 0), 0, 0, &idonly);
+            while(c->more())
+                capped.append(c->next()["_id"]);
+            mongo::BSONObjBuilder queryb;
+            queryb.appendElements(base);
+            queryb.append("exp_key", BSON("$nin" << capped.arr()));
+            if(!claim(queryb.obj(), now))
+                return false;
+            // clear_task gives the slot back
+            m_con.update(m_db+".experiments",
+                    QUERY("_id" << m_current_task["exp_key"]),
+                    BSON("$inc" << BSON("running" << 1)));
+            return true;
+        }
+
+        void clear_task(){
+            try{
+                if(m_fair_share && !m_speculative && !m_current_task.isEmpty())
+                    m_con.update(m_db+".experiments",
+                            QUERY("_id" << m_current_task["exp_key"]),
+                            BSON("$inc" << BSON("running" << -1)));
+                if(m_pool && m_current_task.hasField("resources")){
+                    m_pool->release(m_current_task["resources"].Obj());
+                    advertise_resources();
+                }
+            }catch(std::exception&){
+                // the hub corrects the counters, workers re-advertise at the next claim
+                if(!m_spool)
+                    throw;
+            }
+            m_current_task = mongo::BSONObj();
+            m_claim_result = mongo::BSONObj();
+            m_current_task_timeout_time = boost::posix_time::pos_infin;
+        }
+
+        /// append a log entry, built in place
+        void push_log(int level, const mongo::BSONObj& msg, const std::string* filename){
+            mongo::BSONObjBuilder b(64 + msg.objsize());
+            b.genOID();
+            b.appendAs(m_current_id, "taskid");
+            b.append("level", level);
+            b.append("nr", m_running_nr++);
+            b.appendDate("timestamp", to_mongo_date(universal_date_time()));
+            if(filename)
+                b.append("filename", *filename);
+            b.append("msg", msg);
+            m_log.push_back(b.obj());
+        }
+
         void update_check(Client* c, const boost::system::error_code& error){
-            mongo::BSONObj task;
-            if(c->get_next_task(task))
-                c->handle_task(task);
+            if(m_io.running()){
+                // acquire on the I/O thread, handle_task runs on the executor
+                bool busy;
+                {
+                    boost::recursive_mutex::scoped_lock lock(m_mutex);
+                    busy = m_busy;
+                    m_busy = true;
+                }
+                if(!busy)
+                    c->async_get_next_task(boost::bind(&ClientImpl::got_task, this, c, _1, _2, _3));
+            }else{
+                mongo::BSONObj task;
+                while(c->get_next_task(task)){
+                    c->handle_task(task);
+                    if(!m_cancelled)
+                        break;
+                    // the worker was freed by a cancellation, look for more work right away
+                }
+            }
             if(!error){
                 unsigned int ms;
                 if(m_interval <= 1.f)
@@ -49,136 +1003,264 @@ namespace mdbq
                 m_timer->async_wait(boost::bind(&ClientImpl::update_check,this,c,boost::asio::placeholders::error));
             }
         }
+
+        void set_idle(){
+            boost::recursive_mutex::scoped_lock lock(m_mutex);
+            m_busy = false;
+        }
+
+        void got_task(Client* c, boost::exception_ptr err, bool ok, const mongo::BSONObj& task){
+            if(err){
+                set_idle();
+                boost::rethrow_exception(err);
+            }
+            try{
+                if(ok)
+                    c->handle_task(task);
+            }catch(...){
+                set_idle();
+                throw;
+            }
+            if(ok && m_cancelled){
+                // the worker was freed by a cancellation, look for more work right away
+                c->async_get_next_task(boost::bind(&ClientImpl::got_task, this, c, _1, _2, _3));
+                return;
+            }
+            set_idle();
+        }
+
+        void do_get_next_task(Client* c, task_handler handler){
+            boost::exception_ptr err;
+            bool ok = false;
+            mongo::BSONObj task;
+            try{
+                ok = c->get_next_task(task);
+                task = task.getOwned();
+            }catch(...){
+                err = capture_client_exception();
+            }
+            m_executor->post(boost::bind(handler, err, ok, task));
+        }
+
+        void do_finish(Client* c, mongo::BSONObj result, bool ok, completion_handler handler){
+            boost::exception_ptr err;
+            try{
+                c->finish(result, ok);
+            }catch(...){
+                err = capture_client_exception();
+            }
+            m_executor->post(boost::bind(handler, err));
+        }
+
+        void do_checkpoint(Client* c, bool check_for_timeout, completion_handler handler){
+            boost::exception_ptr err;
+            try{
+                c->checkpoint(check_for_timeout);
+            }catch(...){
+                err = capture_client_exception();
+            }
+            m_executor->post(boost::bind(handler, err));
+        }
     };
     Client::Client(const std::string& url, const std::string& prefix)
         : m_jobcol(prefix+".jobs")
+        , m_archivecol(prefix+".jobs_archive")
         , m_logcol(prefix+".log")
         , m_fscol(prefix+".fs")
         , m_verbose(false)
     {
-        m_ptr.reset(new ClientImpl());
-        m_ptr->m_con.connect(url);
-        CHECK_DB_ERR(m_ptr->m_con);
-
         m_db = prefix;
-        m_ptr->m_fs.reset(new mongo::GridFS(m_ptr->m_con, m_db, "fs"));
+        m_ptr.reset(new ClientImpl());
+        m_ptr->init(url, m_db, mongo::BSONObj());
     }
     Client::Client(const std::string& url, const std::string& prefix, const mongo::BSONObj& query)
         : m_jobcol(prefix+".jobs")
+        , m_archivecol(prefix+".jobs_archive")
         , m_logcol(prefix+".log")
         , m_fscol(prefix+".fs")
         , m_verbose(false)
     {
-        m_ptr.reset(new ClientImpl());
-        m_ptr->m_con.connect(url);
-        m_ptr->m_task_selector = query;
-        CHECK_DB_ERR(m_ptr->m_con);
-
         m_db = prefix;
-        m_ptr->m_fs.reset(new mongo::GridFS(m_ptr->m_con, m_db, "fs"));
+        m_ptr.reset(new ClientImpl());
+        m_ptr->init(url, m_db, query);
     }
     bool Client::get_next_task(mongo::BSONObj& o){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         if(!m_ptr->m_current_task.isEmpty()){
             throw std::runtime_error("MDBQC: do tasks one by one, please!");
         }
         boost::posix_time::ptime now = universal_date_time();
 
-        std::string hostname(256, '\0');
-        gethostname(&hostname[0], 256);
-        std::string hostname_pid = (boost::format("%s:%d") % &hostname[0] % getpid()).str();
+        // results of earlier tasks first, stay idle while the server is unreachable
+        if(m_ptr->m_spool && !m_ptr->drain_spool())
+            return false;
+        m_ptr->flush_due(now);
+        m_ptr->collect_state_files();
 
-        mongo::BSONObjBuilder queryb;
-        mongo::BSONObj res, cmd, query;
-        queryb.append("state", TS_NEW);
-        if(! m_ptr->m_task_selector.isEmpty())
-            queryb.appendElements(m_ptr->m_task_selector);
-        query = queryb.obj();
-        cmd = BSON(
-                "findAndModify" << "jobs" <<
-                "query" << query <<
-                "update"<<BSON("$set"<<
-                    BSON("book_time"<<to_mongo_date(now)
-                        <<"state"<<TS_RUNNING
-                        <<"result.status"<<"running"
-                        <<"refresh_time"<<to_mongo_date(now)
-                        <<"owner"<<hostname_pid)));
-        //std::cout << "cmd: "<< cmd<<std::endl;
-        //m_ptr->m_con.runCommand(m_jobcol,cmd, res);
-        m_ptr->m_con.runCommand(m_db,cmd, res);
-        CHECK_DB_ERR(m_ptr->m_con);
-        //std::cout << "res: "<<res<<std::endl;
-        if(!res["value"].isABSONObj())
+        bool claimed;
+        try{
+            claimed = m_ptr->claim_next(now) ||
+                (m_ptr->m_spec_percentile > 0 && m_ptr->claim_speculative(now));
+        }catch(std::exception& e){
+            if(!m_ptr->m_spool)
+                throw;
+            std::cerr << "MDBQC: WARNING: server unreachable, idle: " << e.what() << std::endl;
+            return false;
+        }
+        if(!claimed)
         {
+            // idle, a good moment to commit queued results
+            m_ptr->flush_finished();
             if(m_verbose)
-                std::cout << "No task available, cmd:" << cmd << std::endl;
+                std::cout << "No task available, query:" << m_ptr->m_claim_query << std::endl;
             return false;
         }
 
-        m_ptr->m_current_task = res["value"].Obj().copy();
-
         int timeout_s = INT_MAX;
         if(m_ptr->m_current_task.hasField("timeout"))
             timeout_s = m_ptr->m_current_task["timeout"].Int();
 
         m_ptr->m_current_task_timeout_time = now + boost::posix_time::seconds(timeout_s);
         m_ptr->m_running_nr = 0;
+        m_ptr->m_cancelled  = false;
 
-        o = m_ptr->m_current_task["misc"].Obj();
+        // m_current_task is a view into the claim result, which the next claim replaces
+        o = m_ptr->m_current_task["misc"].Obj().getOwned();
+
+        m_ptr->m_state_dirty = false;
+        m_ptr->m_state_file.clear();
+        mongo::BSONElement state = m_ptr->m_current_task["saved_state"];
+        if(is_blob_ref(state))
+            m_ptr->m_state_file = state.Obj()["mdbq_blob"].String();
 
         // start logging
+        m_ptr->m_metrics.clear();
         m_ptr->m_log.clear();
+        m_ptr->m_log.reserve(16);
         return true;
     }
     bool Client::get_best_task(mongo::BSONObj& task){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         mongo::BSONObjBuilder queryb;
         // select finished task
         queryb.append("state", TS_OK);
         if(! m_ptr->m_task_selector.isEmpty())
             queryb.appendElements(m_ptr->m_task_selector);
 
-        // order by loss (ascending) and take first result
-        std::auto_ptr<mongo::DBClientCursor> cursor = m_ptr->m_con.query(m_db + ".jobs",
-                mongo::Query(queryb.obj()).sort("result.loss", 1), 1);
+        mongo::BSONObj query = queryb.obj();
+
+        // order by loss (ascending) and take first result,
+        // archived tasks compete with the ones still in the queue
+        mongo::BSONObj best;
+        const std::string* cols[] = {&m_jobcol, &m_archivecol};
+        for(unsigned int i = 0; i < 2; i++){
+            std::auto_ptr<mongo::DBClientCursor> cursor = m_ptr->m_con.query(*cols[i],
+                    mongo::Query(query).sort("result.loss", 1), 1);
+            if (!cursor->more())
+                continue;
+            mongo::BSONObj f = cursor->nextSafe();
+            mongo::BSONElement loss = f["result"]["loss"];
+            if(best.isEmpty() || (loss.isNumber() &&
+                        (!best["result"]["loss"].isNumber() ||
+                         loss.Number() < best["result"]["loss"].Number())))
+                best = f.copy();
+        }
 
-        if (!cursor->more()) {
+        if (best.isEmpty()) {
             // no task found
             return false;
         }
 
-        task = cursor->nextSafe().copy();
+        task = best;
         return true;
     }
     void Client::finish(const mongo::BSONObj& result, bool ok){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         const mongo::BSONObj& ct = m_ptr->m_current_task;
         if(ct.isEmpty()){
             throw std::runtime_error("MDBQC: get a task first before you finish!");
         }
 
-        this->checkpoint(false); // flush logs, do not check for timeout
+        m_ptr->flush_log(m_logcol);
+        m_ptr->flush_metrics();
 
-        boost::posix_time::ptime finish_time = universal_date_time();
+        mongo::Date_t finish_time = to_mongo_date(universal_date_time());
         int version = ct["version"].Int();
+
+        mongo::BSONObjBuilder queryb(64);
+        queryb.append(m_ptr->m_current_id);
+        queryb.append("version", version);
+
+        mongo::BSONObjBuilder updateb(128 + result.objsize());
+        {
+            mongo::BSONObjBuilder setb(updateb.subobjStart("$set"));
+            if(ok){
+                setb.append("state", TS_OK);
+                setb.append("version", version+1);
+                setb.appendDate("finish_time", finish_time);
+                setb.append("result", result);
+            }else{
+                setb.append("state", TS_FAILED);
+                setb.append("version", version+1);
+                setb.appendDate("failure_time", finish_time);
+                setb.append("result.status", "fail");
+                setb.append("error", result);
+            }
+            setb.done();
+            if(ok){
+                // a finished task is not resumed, free its state
+                mongo::BSONObjBuilder unsetb(updateb.subobjStart("$unset"));
+                unsetb.append("saved_state", 1);
+                unsetb.done();
+            }
+        }
+        if(!ok && m_ptr->m_speculative){
+            // a failed duplicate must not fail the original attempt,
+            // unless the original timed out and handed the task over
+            m_ptr->drop_speculative();
+            queryb.append("owner", m_ptr->m_owner);
+            m_ptr->spooled_update(m_jobcol, queryb.done(), updateb.done(), WO_FINISH);
+            m_ptr->clear_task();
+            return;
+        }
+        if(m_ptr->m_group_commit > 1){
+            ClientImpl::PendingFinish pf;
+            pf.query   = queryb.obj();
+            pf.update  = updateb.obj();
+            pf.version = version;
+            // the hub must not time the task out while its result waits
+            pf.flush_by = std::min(universal_date_time() + boost::posix_time::seconds(m_ptr->m_group_delay),
+                    m_ptr->m_current_task_timeout_time);
+            m_ptr->m_pending.push_back(pf);
+            if(ok)
+                // removed once the result is committed, see collect_state_files
+                m_ptr->release_state_file(m_ptr->m_state_file);
+            m_ptr->clear_task(); // empty, call get_next_task.
+            if(m_ptr->m_pending.size() >= m_ptr->m_group_commit)
+                m_ptr->flush_finished();
+            return;
+        }
+        int n = m_ptr->spooled_update(m_jobcol, queryb.done(), updateb.done(), WO_FINISH);
+        std::string err;
+        mongo::BSONObj id = m_ptr->m_current_id.wrap();
+        if(n == 0){
+            // lost the version guard, unless another attempt finished the task
+            mongo::BSONObj fields = BSON("state" << 1);
+            mongo::BSONObj cur = m_ptr->m_con.findOne(m_jobcol, mongo::Query(id), &fields);
+            if(cur.isEmpty())
+                err = "task was removed";
+            else if(!ok || cur["state"].numberInt() != TS_OK)
+                err = "task was rescheduled or finished by someone else";
+        }
         if(ok)
-            m_ptr->m_con.update(m_jobcol,
-                    QUERY("_id"<<ct["_id"]<<
-                        "version"<<version),
-                    BSON("$set"<<BSON(
-                        "state"<<TS_OK<<
-                        "version"<<version+1<<
-                        "finish_time"<<to_mongo_date(finish_time)<<
-                        "result"<<result)));
-        else
-            m_ptr->m_con.update(m_jobcol,
-                    QUERY("_id"<<ct["_id"]<<
-                        "version"<<version),
-                    BSON("$set"<<BSON(
-                        "state"<<TS_FAILED<<
-                        "version"<<version+1<<
-                        "failure_time"<<to_mongo_date(finish_time)<<
-                        "result.status"<<"fail"<<
-                        "error"<<result)));
-        CHECK_DB_ERR(m_ptr->m_con);
-        m_ptr->m_current_task = mongo::BSONObj(); // empty, call get_next_task.
+            m_ptr->release_state_file(m_ptr->m_state_file);
+        m_ptr->clear_task(); // empty, call get_next_task.
+        m_ptr->collect_state_files();
+        if(err.empty())
+            return;
+        if(!m_ptr->m_on_finish_error)
+            throw std::runtime_error("MDBQC: result not committed: " + err);
+        m_ptr->m_on_finish_error(id, err);
     }
     void Client::reg(boost::asio::io_service& io_service, float interval){
         m_ptr->m_interval = interval;
@@ -192,54 +1274,194 @@ namespace mdbq
         std::cerr <<"MDBQC: WARNING: got a task, but no handler defined!"<<std::endl;
         finish(BSON("error"<<true));
     }
-    Client::~Client(){ }
+    void Client::start_io_thread(boost::asio::io_service& executor){
+        m_ptr->m_executor = &executor;
+        m_ptr->m_io.start();
+    }
+    void Client::stop_io_thread(){
+        m_ptr->m_io.stop();
+    }
+    void Client::async_get_next_task(const task_handler& handler){
+        m_ptr->m_io.post(boost::bind(&ClientImpl::do_get_next_task, m_ptr.get(), this, handler));
+    }
+    void Client::async_finish(const mongo::BSONObj& result, bool ok, const completion_handler& handler){
+        m_ptr->m_io.post(boost::bind(&ClientImpl::do_finish, m_ptr.get(), this, result.getOwned(), ok, handler));
+    }
+    void Client::async_checkpoint(const completion_handler& handler, bool check_for_timeout){
+        m_ptr->m_io.post(boost::bind(&ClientImpl::do_checkpoint, m_ptr.get(), this, check_for_timeout, handler));
+    }
+    void Client::set_write_concern(WriteOp op, WriteConcern wc){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_write_concern[op] = wc;
+    }
+    void Client::set_fair_share(bool on){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_fair_share = on;
+        if(on)
+            m_ptr->m_con.ensureIndex(m_jobcol, BSON("state"<<1 << "exp_key"<<1));
+    }
+    void Client::set_spool(const std::string& path, size_t max_bytes, double so_timeout){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(path.empty()){
+            m_ptr->m_spool.reset();
+            m_ptr->m_con.setSoTimeout(0); // the driver's default
+            return;
+        }
+        m_ptr->m_spool.reset(new Spool(path, max_bytes));
+        m_ptr->m_con.setSoTimeout(so_timeout);
+        m_ptr->drain_spool(); // left over from a previous run
+    }
+    void Client::set_speculative(double percentile, unsigned int min_peers){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(percentile < 0. || percentile >= 1.)
+            throw std::runtime_error("MDBQC: percentile must be in [0, 1)");
+        m_ptr->m_spec_percentile  = percentile;
+        m_ptr->m_spec_min_peers   = min_peers;
+        m_ptr->m_spec_next_update = boost::posix_time::neg_infin;
+    }
+    void Client::save_state(const char* ptr, size_t len){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(m_ptr->m_current_task.isEmpty()){
+            throw std::runtime_error("MDBQC: get a task first before you save its state!");
+        }
+        if(m_ptr->m_speculative)
+            return; // the original attempt owns the state
+        m_ptr->m_state.assign(ptr, len);
+        m_ptr->m_state_dirty = true;
+    }
+    bool Client::load_state(std::string& state){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(m_ptr->m_current_task.isEmpty()){
+            throw std::runtime_error("MDBQC: get a task first before you load its state!");
+        }
+        mongo::BSONElement e = m_ptr->m_current_task["saved_state"];
+        if(e.eoo())
+            return false;
+        int len;
+        if(is_blob_ref(e)){
+            mongo::BSONObj blob = mdbq::fetch_blob(*m_ptr->m_fs, e.Obj(), "saved_state");
+            const char* p = blob["saved_state"].binData(len);
+            state.assign(p, len);
+        }else{
+            const char* p = e.binData(len);
+            state.assign(p, len);
+        }
+        return true;
+    }
+    void Client::set_affinity(unsigned int max_wait, unsigned int n_warm){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_affinity_wait = max_wait;
+        m_ptr->m_n_warm        = n_warm;
+        while(m_ptr->m_recent_keys.size() > n_warm)
+            m_ptr->m_recent_keys.pop_back();
+        if(max_wait)
+            m_ptr->m_con.ensureIndex(m_jobcol, BSON("state"<<1 << "affinity"<<1));
+    }
+    void Client::set_warm_keys(const std::vector<std::string>& keys){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_warm_keys = keys;
+        if(m_ptr->m_affinity_wait)
+            m_ptr->advertise_warm_keys(universal_date_time());
+    }
+    void Client::set_task_fields(const mongo::BSONObj& fields){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(fields.isEmpty()){
+            m_ptr->m_claim_fields = mongo::BSONObj();
+            return;
+        }
+        // fields the client needs itself
+        mongo::BSONObjBuilder bob;
+        bob.append("_id", 1);
+        bob.append("version", 1);
+        bob.append("timeout", 1);
+        bob.append("exp_key", 1);
+        bob.append("resources", 1);
+        bob.append("saved_state", 1);
+        bob.append("affinity", 1);
+        mongo::BSONObjIterator it(fields);
+        while(it.more())
+            bob.append(std::string("misc.") + it.next().fieldName(), 1);
+        m_ptr->m_claim_fields = bob.obj();
+    }
+    mongo::BSONObj Client::fetch_blob(const mongo::BSONObj& task, const std::string& field){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        mongo::BSONElement e = task[field];
+        if(e.eoo())
+            throw std::runtime_error("MDBQC: task has no field `" + field + "'");
+        if(!is_blob_ref(e))
+            return e.wrap();
+        return mdbq::fetch_blob(*m_ptr->m_fs, e.Obj(), field);
+    }
+    void Client::stream_blob(const mongo::BSONObj& task, const std::string& field, std::ostream& os){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        mongo::BSONElement e = task[field];
+        if(!is_blob_ref(e))
+            throw std::runtime_error("MDBQC: field `" + field + "' was not offloaded");
+        mdbq::stream_blob(*m_ptr->m_fs, e.Obj(), os);
+    }
+    void Client::set_resources(const boost::shared_ptr<ResourcePool>& pool){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_pool = pool;
+        if(pool)
+            m_ptr->advertise_resources();
+    }
+    void Client::set_group_commit(unsigned int max_batch, const finish_error_handler& on_error, unsigned int max_delay){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_on_finish_error = on_error;
+        m_ptr->m_group_commit    = max_batch;
+        m_ptr->m_group_delay     = max_delay;
+        if(max_batch <= 1)
+            m_ptr->flush_finished();
+    }
+    unsigned int Client::flush_finished(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        return m_ptr->flush_finished();
+    }
+    Client::~Client(){
+        // pending operations refer to this object
+        m_ptr->m_io.stop();
+        try{
+            m_ptr->flush_finished();
+        }catch(std::exception& e){
+            std::cerr << "MDBQC: WARNING: results lost on destruction: " << e.what() << std::endl;
+        }
+        if(m_ptr->m_spool && !m_ptr->drain_spool())
+            std::cerr << "MDBQC: WARNING: " << m_ptr->m_spool->used()
+                << " bytes left in spool, replayed by the next client using it" << std::endl;
+    }
     void Client::log(int level, const mongo::BSONObj& msg){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         const mongo::BSONObj& ct = m_ptr->m_current_task;
         if(ct.isEmpty()){
             throw std::runtime_error("MDBQC: get a task first before you log something about it!");
         }
-        boost::posix_time::ptime now = universal_date_time();
-        m_ptr->m_log.push_back(BSON( 
-                    mongo::GENOID<<
-                    "taskid"<<ct["_id"]<<
-                    "level"<<level<<
-                    "nr" << m_ptr->m_running_nr++ <<
-                    "timestamp"<< to_mongo_date(now)<<
-                    "msg"<<msg));
+        m_ptr->push_log(level, msg, NULL);
     }
     void Client::log(int level, const char* ptr, size_t len, const mongo::BSONObj& msg){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         mongo::BSONObj& ct = m_ptr->m_current_task;
         if(ct.isEmpty()){
             throw std::runtime_error("MDBQC: get a task first before you log something about it!");
         }
 
-        boost::uuids::basic_random_generator<boost::mt19937> gen;
-        mongo::BSONObj ret = m_ptr->m_fs->storeFile(ptr,len, boost::lexical_cast<std::string>(gen()));
-        CHECK_DB_ERR(m_ptr->m_con);
+        mongo::BSONObj ret = m_ptr->m_fs->storeFile(ptr,len, boost::lexical_cast<std::string>(m_ptr->m_uuid_gen()));
+        m_ptr->check_write(WO_LOG);
         {
             mongo::BSONObjBuilder bob;
             bob.appendElements(ret);
             bob.appendElements(msg);
+            bob.appendAs(m_ptr->m_current_id, "taskid"); // for orphan cleanup
             m_ptr->m_con.update(m_fscol+".files",
                     BSON("filename"<<ret.getField("filename")),
                     bob.obj(),false,false);
-            CHECK_DB_ERR(m_ptr->m_con);
+            m_ptr->check_write(WO_LOG);
         }
 
-        mongo::BSONObjBuilder bob;
-        bob.appendElements(msg);
-        bob.append("filename",ret["filename"].String());
-        m_ptr->m_log.push_back(BSON(
-                    mongo::GENOID<<
-                    "taskid"<<ct["_id"]<<
-                    "level"<<level<<
-                    "nr" << m_ptr->m_running_nr++ <<
-                    "timestamp"<<to_mongo_date(universal_date_time())<<
-                    "filename" << ret["filename"].String()<<
-                    "msg"<<msg
-                    ));
+        std::string filename = ret["filename"].String();
+        m_ptr->push_log(level, msg, &filename);
     }
     void Client::checkpoint(bool check_for_timeout){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         const mongo::BSONObj& ct = m_ptr->m_current_task;
         if(ct.isEmpty()){
             throw std::runtime_error("MDBQC: get a task first before you call checkpoints!");
@@ -248,44 +1470,230 @@ namespace mdbq
         if(check_for_timeout){   // first, check whether the task has timed out.
             boost::posix_time::ptime now = universal_date_time();
             if(now >= m_ptr->m_current_task_timeout_time){
-                std::string hostname(256, '\0');
-                gethostname(&hostname[0], 256);
-                std::string hostname_pid = (boost::format("%s:%d") % &hostname[0] % getpid()).str();
-
-                // set to failed in DB
-                m_ptr->m_con.update(m_jobcol, 
-                        QUERY("_id"<<ct["_id"] << 
-                            // do not overwrite job that has been taken by someone else!
-                            // this may happen due to timeouts and rescheduling.
-                            "owner"<<hostname_pid),
-                        BSON("$set" << 
-                            BSON("state"<<TS_FAILED<< 
-                                 "error"<<"timeout")));
-                CHECK_DB_ERR(m_ptr->m_con);
+                if(m_ptr->m_speculative)
+                    m_ptr->drop_speculative();
+                // set to failed in DB, unless a running duplicate takes over
+                if(m_ptr->m_speculative || !m_ptr->hand_over())
+                    m_ptr->spooled_update(m_jobcol, 
+                            BSON(m_ptr->m_current_id << 
+                                // do not overwrite job that has been taken by someone else!
+                                // this may happen due to timeouts and rescheduling.
+                                "owner"<<m_ptr->m_owner),
+                            BSON("$set" << 
+                                BSON("state"<<TS_FAILED<< 
+                                     "failure_time"<<to_mongo_date(now)<<
+                                     "error"<<"timeout")),
+                            WO_STATUS);
 
                 // clean up current state
-                m_ptr->m_current_task = mongo::BSONObj();
-                m_ptr->m_current_task_timeout_time = boost::posix_time::pos_infin;
+                m_ptr->clear_task();
 
                 throw timeout_exception();
             }
         }
 
+        // the heartbeat returns the cancellation flag, so that detecting
+        // cancellation does not cost an extra round trip.
         boost::posix_time::ptime now = universal_date_time();
-        m_ptr->m_con.update(m_jobcol,
-                QUERY("_id"<<ct["_id"]),
-                BSON( "$set"<<BSON("refresh_time"<<to_mongo_date(now))));
-        CHECK_DB_ERR(m_ptr->m_con);
+        if(!m_ptr->m_spool)
+            // with a spool, results wait until get_next_task drained it
+            m_ptr->flush_due(now);
+        mongo::BSONObj res;
+        mongo::BSONObj state;
+        bool landed = false;
+        try{
+            if(m_ptr->m_spool)
+                m_ptr->reconnect();
+            if(m_ptr->m_state_dirty)
+                state = m_ptr->make_state();
+            mongo::BSONObjBuilder cmdb(160);
+            cmdb.append("findAndModify", "jobs");
+            {
+                mongo::BSONObjBuilder queryb(cmdb.subobjStart("query"));
+                queryb.append(m_ptr->m_current_id);
+                if(!state.isEmpty()){
+                    // never overwrite the state of someone else's attempt
+                    queryb.append("version", ct["version"].numberInt());
+                    queryb.append("state", TS_RUNNING);
+                    queryb.append("owner", m_ptr->m_owner);
+                }
+                queryb.done();
+            }
+            {
+                mongo::BSONObjBuilder updateb(cmdb.subobjStart("update"));
+                mongo::BSONObjBuilder setb(updateb.subobjStart("$set"));
+                setb.appendDate("refresh_time", to_mongo_date(now));
+                setb.appendElements(state);
+                setb.done();
+                updateb.done();
+            }
+            cmdb.append("fields", BSON("cancelled"<<1 << "state"<<1 << "version"<<1 << "saved_state.mdbq_blob"<<1));
+            m_ptr->find_and_modify(cmdb.done(), res, WO_STATUS);
+            landed = true;
+            if(m_ptr->m_affinity_wait && now >= m_ptr->m_warm_refresh)
+                // busy clients keep their warm keys
+                m_ptr->advertise_warm_keys(now);
+        }catch(std::exception& e){
+            // the task does not refer to a new state file
+            m_ptr->release_state_file(ClientImpl::state_file(state));
+            // keep computing through outages, the logs go to the spool
+            if(!m_ptr->m_spool)
+                throw;
+            res = mongo::BSONObj();
+        }
+
+        m_ptr->flush_log(m_logcol);
+        m_ptr->flush_metrics();
 
-        if(m_ptr->m_log.size()) {
-            m_ptr->m_con.insert(m_logcol, m_ptr->m_log);
-            m_ptr->m_log.clear();
-            CHECK_DB_ERR(m_ptr->m_con);
+        if(!state.isEmpty() && landed){
+            std::string file = ClientImpl::state_file(state);
+            if(res["value"].isABSONObj()){
+                // the task refers to the new state, the previous file can go
+                if(m_ptr->m_state_file != file)
+                    m_ptr->release_state_file(m_ptr->m_state_file);
+                m_ptr->m_state_file  = file;
+                m_ptr->m_state_dirty = false;
+                m_ptr->collect_state_files();
+            }else{
+                // rescheduled or finished by someone else
+                m_ptr->release_state_file(file);
+                m_ptr->release_state_file(m_ptr->m_state_file);
+                m_ptr->clear_task();
+                m_ptr->collect_state_files();
+                m_ptr->m_cancelled = true;
+                throw cancelled_exception();
+            }
         }
 
+        if(res["value"].isABSONObj()){
+            // someone else finished the task, e.g. a speculative duplicate
+            mongo::BSONObj cur = res["value"].Obj();
+            if(m_ptr->m_speculative)
+                // the original attempt may replace its state file, we free the last one when we win
+                m_ptr->m_state_file = ClientImpl::state_file(cur);
+            if(cur["state"].numberInt() != TS_RUNNING || cur["version"].numberInt() != ct["version"].numberInt()){
+                m_ptr->release_state_file(m_ptr->m_state_file);
+                m_ptr->clear_task();
+                m_ptr->collect_state_files();
+                m_ptr->m_cancelled = true;
+                throw cancelled_exception();
+            }
+        }
+        if(res["value"].isABSONObj() && res["value"].Obj()["cancelled"].trueValue()){
+            m_ptr->spooled_update(m_jobcol,
+                    BSON(m_ptr->m_current_id<<"state"<<TS_RUNNING),
+                    BSON("$set" <<
+                        BSON("state"<<TS_CANCELLED<<
+                             "failure_time"<<to_mongo_date(now))),
+                    WO_STATUS);
+
+            // clean up current state
+            m_ptr->clear_task();
+            m_ptr->m_cancelled = true;
+
+            throw cancelled_exception();
+        }
+
+    }
+    void Client::metric(const std::string& name, long long step, double value){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(m_ptr->m_current_task.isEmpty()){
+            throw std::runtime_error("MDBQC: get a task first before you log something about it!");
+        }
+        ClientImpl::MetricBuffer& mb = m_ptr->m_metrics[name];
+        mb.steps.push_back(step);
+        mb.values.push_back(value);
+    }
+    void Client::get_metric(const mongo::BSONObj& task, const std::string& name,
+            std::vector<long long>& steps, std::vector<double>& values,
+            long long from, long long to, unsigned int max_points){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        steps.clear();
+        values.clear();
+        mongo::BSONObj match = BSON("taskid" << task["_id"] << "name" << name <<
+                "last" << BSON("$gte" << from) << "first" << BSON("$lte" << to));
+
+        if(max_points){
+            // look at the summaries first, the points are only fetched if there are few enough
+            mongo::BSONObj stats = m_ptr->aggregate_metrics(BSON_ARRAY(
+                        BSON("$match" << match) <<
+                        BSON("$group" << BSON(
+                                "_id"     << 0 <<
+                                "lo"      << BSON("$min" << "$first") <<
+                                "hi"      << BSON("$max" << "$last") <<
+                                "n"       << BSON("$sum" << "$n") <<
+                                "buckets" << BSON("$sum" << 1)))));
+            std::vector<mongo::BSONElement> r = stats["result"].Array();
+            if(r.empty())
+                return;
+            stats = r[0].Obj();
+            if(stats["n"].numberLong() > max_points){
+                // mean values of max_points intervals of equal width
+                long long lo = std::max(from, stats["lo"].numberLong());
+                long long hi = std::min(to,   stats["hi"].numberLong());
+                double width = std::max(1., (hi - lo + 1.) / max_points);
+                std::map<long long, ClientImpl::MetricBin> bins;
+                if(stats["buckets"].numberLong() >= max_points){
+                    // buckets are narrower than intervals, merge the summaries of
+                    // those inside the range on the server, and clip the others
+                    mongo::BSONObj rel = BSON("$divide" << BSON_ARRAY(
+                                BSON("$subtract" << BSON_ARRAY("$first" << lo)) << width));
+                    mongo::BSONObj res = m_ptr->aggregate_metrics(BSON_ARRAY(
+                                BSON("$match" << BSON("taskid" << task["_id"] << "name" << name <<
+                                        "first" << BSON("$gte" << from) << "last" << BSON("$lte" << to))) <<
+                                BSON("$group" << BSON(
+                                        "_id"  << BSON("$subtract" << BSON_ARRAY(rel << BSON("$mod" << BSON_ARRAY(rel << 1)))) <<
+                                        "n"    << BSON("$sum" << "$n") <<
+                                        "sum"  << BSON("$sum" << "$sum") <<
+                                        "step" << BSON("$sum" << BSON("$multiply" << BSON_ARRAY("$n" <<
+                                                    BSON("$divide" << BSON_ARRAY(BSON("$add" << BSON_ARRAY("$first" << "$last")) << 2)))))))));
+                    std::vector<mongo::BSONElement> groups = res["result"].Array();
+                    for(unsigned int i = 0; i < groups.size(); i++){
+                        mongo::BSONObj g = groups[i].Obj();
+                        ClientImpl::MetricBin& b = bins[(long long)g["_id"].Number()];
+                        b.n    += g["n"].Number();
+                        b.sum  += g["sum"].Number();
+                        b.step += g["step"].Number();
+                    }
+                    m_ptr->bin_points(QUERY("taskid" << task["_id"] << "name" << name <<
+                                "last" << mongo::GTE << from << "first" << mongo::LTE << to <<
+                                "$or" << BSON_ARRAY(
+                                    BSON("first" << BSON("$lt" << from)) <<
+                                    BSON("last"  << BSON("$gt" << to)))),
+                            from, to, lo, width, bins);
+                }else{
+                    // buckets are wider than intervals, only the points have the resolution
+                    m_ptr->bin_points(mongo::Query(match), from, to, lo, width, bins);
+                }
+                for(std::map<long long, ClientImpl::MetricBin>::const_iterator it = bins.begin(); it != bins.end(); ++it){
+                    if(it->second.n <= 0)
+                        continue;
+                    steps.push_back((long long)(it->second.step / it->second.n + 0.5));
+                    values.push_back(it->second.sum / it->second.n);
+                }
+                return;
+            }
+        }
+
+        std::auto_ptr<mongo::DBClientCursor> p = m_ptr->m_con.query(m_db+".metrics", mongo::Query(match).sort("first"));
+        CHECK_DB_ERR(m_ptr->m_con);
+        while(p->more()){
+            mongo::BSONObj f = p->next();
+            int len;
+            const long long* s = (const long long*)f["steps"].binData(len);
+            const double*    v = (const double*)f["values"].binData(len);
+            int n = f["n"].numberInt();
+            for(int i = 0; i < n; i++){
+                if(s[i] < from || s[i] > to)
+                    continue;
+                steps.push_back(s[i]);
+                values.push_back(v[i]);
+            }
+        }
     }
     std::vector<mongo::BSONObj> 
     Client::get_log(const mongo::BSONObj& task){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         std::auto_ptr<mongo::DBClientCursor> p =
             m_ptr->m_con.query( m_logcol, 
                     QUERY("taskid" << task["_id"]).sort("nr"));
@@ -298,4 +1706,59 @@ namespace mdbq
         return log;
     }
 
+
+    ResourcePool::ResourcePool(const mongo::BSONObj& capacity){
+        mongo::BSONObjIterator it(capacity);
+        while(it.more()){
+            mongo::BSONElement e = it.next();
+            if(!e.isNumber())
+                throw std::runtime_error(std::string("MDBQC: resource `") + e.fieldName() + "' is not numeric");
+            m_capacity[e.fieldName()] = e.Number();
+        }
+        m_available = m_capacity;
+    }
+    mongo::BSONObj ResourcePool::capacity()const{
+        boost::mutex::scoped_lock lock(m_mutex);
+        mongo::BSONObjBuilder bob;
+        for(std::map<std::string, double>::const_iterator it = m_capacity.begin(); it != m_capacity.end(); ++it)
+            bob.append(it->first, it->second);
+        return bob.obj();
+    }
+    mongo::BSONObj ResourcePool::available()const{
+        boost::mutex::scoped_lock lock(m_mutex);
+        mongo::BSONObjBuilder bob;
+        for(std::map<std::string, double>::const_iterator it = m_available.begin(); it != m_available.end(); ++it)
+            bob.append(it->first, it->second);
+        return bob.obj();
+    }
+    bool ResourcePool::reserve(const mongo::BSONObj& req){
+        boost::mutex::scoped_lock lock(m_mutex);
+        return reserve_locked(req);
+    }
+    bool ResourcePool::reserve_locked(const mongo::BSONObj& req){
+        mongo::BSONObjIterator check(req);
+        while(check.more()){
+            mongo::BSONElement e = check.next();
+            std::map<std::string, double>::iterator it = m_available.find(e.fieldName());
+            if(it == m_available.end() || it->second < e.Number())
+                return false;
+        }
+        mongo::BSONObjIterator take(req);
+        while(take.more()){
+            mongo::BSONElement e = take.next();
+            m_available[e.fieldName()] -= e.Number();
+        }
+        return true;
+    }
+    void ResourcePool::release(const mongo::BSONObj& req){
+        boost::mutex::scoped_lock lock(m_mutex);
+        mongo::BSONObjIterator it(req);
+        while(it.more()){
+            mongo::BSONElement e = it.next();
+            std::map<std::string, double>::iterator a = m_available.find(e.fieldName());
+            if(a != m_available.end())
+                a->second = std::min(a->second + e.Number(), m_capacity[e.fieldName()]);
+        }
+    }
+
 }
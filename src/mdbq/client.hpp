@@ -1,10 +1,16 @@
 #ifndef __MDBQ_CLIENT_HPP__
 #     define __MDBQ_CLIENT_HPP__
 
+#include <climits>
 #include <stdexcept>
+#include <iosfwd>
 #include <vector>
+#include <map>
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
 #include <string>
+#include "async.hpp"
 
 namespace mongo{
     class BSONObj;
@@ -24,12 +30,96 @@ namespace mdbq
             timeout_exception() : std::runtime_error("MDBQ Timeout") {}
     };
 
+    class cancelled_exception : public std::runtime_error{
+        public:
+            cancelled_exception() : std::runtime_error("MDBQ Cancelled") {}
+    };
+
+
+    /**
+     * durability of the writes issued by a client
+     */
+    enum WriteConcern{
+        WC_UNACKNOWLEDGED, ///< fire and forget
+        WC_ACKNOWLEDGED,   ///< wait until the server applied the write
+        WC_JOURNALED       ///< wait until the write is in the server's journal
+    };
+
+    /**
+     * kinds of writes issued by a client (see Client::set_write_concern)
+     */
+    enum WriteOp{
+        WO_LOG,     ///< log entries and logged files
+        WO_STATUS,  ///< claims, heartbeats, marking tasks as timed out or cancelled
+        WO_FINISH,  ///< task results
+        WO_N_OPS
+    };
+
+    /**
+     * called for each task whose result could not be committed.
+     *
+     * arguments are the _id of the task and the error message.
+     */
+    typedef boost::function<void (const mongo::BSONObj&, const std::string&)> finish_error_handler;
 
     struct ClientImpl;
+
+    /**
+     * resources of a worker process, shared by its clients.
+     *
+     * Clients using a pool only claim jobs whose requirements (see
+     * Hub::insert_job) fit into what is available, and hold the job's
+     * resources until it is finished. Several clients sharing one pool,
+     * each running in its own thread, thus fill up a machine with as many
+     * jobs as fit.
+     *
+     * Jobs requiring a resource which is not in the pool are never
+     * claimed, list a resource with capacity 0 to be explicit.
+     */
+    class ResourcePool{
+        private:
+            friend struct ClientImpl;
+            mutable boost::mutex m_mutex;
+            std::map<std::string, double> m_capacity;
+            std::map<std::string, double> m_available;
+            bool reserve_locked(const mongo::BSONObj& req);
+        public:
+            /**
+             * ctor.
+             *
+             * @param capacity numeric resources, e.g. BSON("mem_gb"<<64<<"cores"<<16)
+             */
+            ResourcePool(const mongo::BSONObj& capacity);
+
+            /**
+             * get the total resources.
+             */
+            mongo::BSONObj capacity()const;
+
+            /**
+             * get the resources not held by running jobs.
+             */
+            mongo::BSONObj available()const;
+
+            /**
+             * take resources if they are available.
+             *
+             * @param req numeric requirements
+             * @return false (and take nothing) if req does not fit
+             */
+            bool reserve(const mongo::BSONObj& req);
+
+            /**
+             * return resources taken with reserve().
+             */
+            void release(const mongo::BSONObj& req);
+    };
+
     class Client{
         private:
             boost::shared_ptr<ClientImpl> m_ptr;
             std::string m_jobcol;
+            std::string m_archivecol;
             std::string m_logcol;
             std::string m_fscol;
             std::string m_db;
@@ -53,12 +143,106 @@ namespace mdbq
 
             /**
              * acquire a new task in o.
+             *
+             * o owns its buffer and stays valid after finish().
              */
             bool get_next_task(mongo::BSONObj& o);
 
+            /**
+             * prefer tasks whose data this client has loaded already.
+             *
+             * the affinity keys (see Hub::insert_job) of the last n_warm
+             * tasks, plus those given to set_warm_keys, count as warm and
+             * are reported in the workers collection. Tasks with a warm
+             * key are claimed first. Other clients leave tasks to their
+             * warm clients for at most max_wait seconds, and a client
+             * which found no task it prefers for max_wait seconds takes
+             * any task.
+             *
+             * @param max_wait seconds, 0 disables affinity routing
+             * @param n_warm number of recent affinity keys to consider warm
+             */
+            void set_affinity(unsigned int max_wait, unsigned int n_warm=4);
+
+            /**
+             * declare affinity keys as warm, e.g. datasets loaded at startup (see set_affinity).
+             */
+            void set_warm_keys(const std::vector<std::string>& keys);
+
+            /**
+             * run duplicates of stragglers while idle.
+             *
+             * if there is no new task, claim a duplicate attempt of a
+             * running task whose run time exceeds the given percentile
+             * of recently finished tasks. Each task gets at most one
+             * duplicate. The first attempt to finish wins, the other one
+             * gets a cancelled_exception at its next checkpoint. Failures
+             * and timeouts of duplicates do not affect the original.
+             *
+             * @param percentile e.g. 0.9, 0 disables speculative execution
+             * @param min_peers number of finished tasks needed to estimate the percentile
+             */
+            void set_speculative(double percentile, unsigned int min_peers=10);
+
+            /**
+             * keep computing while the server is slow or unavailable.
+             *
+             * logs, metrics and results which cannot be written are
+             * appended to a local memory-mapped file, and replayed in
+             * order once the server is back. Replaying is idempotent, and
+             * a spool left by a crashed worker is replayed by the next
+             * client opening it. While the spool is full, writes throw,
+             * and finish() can be retried. While the server is
+             * unreachable, get_next_task() returns false.
+             *
+             * All writes are acknowledged with a spool, since the client
+             * needs to know whether they arrived. Files logged to GridFS
+             * are not spooled.
+             *
+             * @param path spool file, one per client. Empty disables spooling.
+             * @param max_bytes size of the spool
+             * @param so_timeout socket timeout in seconds, after which the
+             *        server is considered unreachable
+             */
+            void set_spool(const std::string& path, size_t max_bytes=64*1024*1024, double so_timeout=10);
+
+            /**
+             * only fetch the given fields of the task description at claim time.
+             *
+             * @param fields fields of the task description, e.g. BSON("x"<<1<<"y"<<1).
+             *        Empty fetches the whole description.
+             */
+            void set_task_fields(const mongo::BSONObj& fields);
+
+            /**
+             * get a field of the task description, loading it if it was offloaded.
+             *
+             * see Hub::set_offload_threshold. Fields which were not
+             * offloaded are returned as they are.
+             *
+             * @param task the task description, as returned by get_next_task
+             * @param field name of the field
+             * @return a document with field as its only field
+             */
+            mongo::BSONObj fetch_blob(const mongo::BSONObj& task, const std::string& field);
+
+            /**
+             * write the contents of an offloaded field to a stream, chunk by chunk.
+             *
+             * strings and binary data are written as raw bytes, other
+             * values as a BSON document {v: value}.
+             *
+             * @param task the task description, as returned by get_next_task
+             * @param field name of the field
+             * @param os where to write to
+             */
+            void stream_blob(const mongo::BSONObj& task, const std::string& field, std::ostream& os);
+
             /**
              * find and return the task, including result details, which has minimal loss
              *
+             * archived tasks are considered as well.
+             *
              * @param task set to finished task with minimal loss, if finished tasks exist
              *
              * returns true if a finished task exists and is store to task
@@ -67,11 +251,78 @@ namespace mdbq
 
             /**
              * finish the task.
+             *
+             * the result is only written if the task was not rescheduled
+             * or finished by someone else meanwhile. Otherwise, the error
+             * handler of set_group_commit() is called, or finish() throws
+             * if there is none.
+             *
              * @param result a description of the result
              * @param ok if false, task may be rescheduled by hub
              */
             void finish(const mongo::BSONObj& result, bool ok=1);
 
+            /**
+             * claim tasks in fair share across experiments.
+             *
+             * tasks are taken from the experiments (the exp_key of a job)
+             * in proportion to the weights and within the caps configured
+             * with Hub::set_experiment_share. Jobs of uncapped experiments
+             * unknown to the bookkeeping, e.g. inserted by a third party,
+             * are handed out when no known experiment has a job to give.
+             *
+             * @param on whether to enable fair-share scheduling
+             */
+            void set_fair_share(bool on=true);
+
+            /**
+             * only claim tasks which fit into the available resources.
+             *
+             * the pool is updated as tasks are claimed and finished, and
+             * advertised in <prefix>.workers.
+             *
+             * @param pool resources, possibly shared with other clients
+             */
+            void set_resources(const boost::shared_ptr<ResourcePool>& pool);
+
+            /**
+             * set the durability of one kind of writes.
+             *
+             * unacknowledged writes are not checked for errors. All kinds
+             * default to WC_ACKNOWLEDGED.
+             *
+             * @param op the kind of writes
+             * @param wc the durability
+             */
+            void set_write_concern(WriteOp op, WriteConcern wc);
+
+            /**
+             * commit results of finished tasks in groups.
+             *
+             * finish() then only queues the result. Queued results are
+             * written in a single bulk update (requires MongoDB >= 2.6)
+             * when max_batch results are queued, when no task is available
+             * in get_next_task(), and in flush_finished(). A result waits
+             * at most max_delay seconds, and not past the timeout of its
+             * task; this is checked in get_next_task() and checkpoint().
+             * The version guard of finish() applies to every result
+             * individually.
+             *
+             * @param max_batch maximum number of queued results, <= 1 disables grouping
+             * @param on_error called for each result which could not be
+             *        committed. If empty, flushing throws instead.
+             * @param max_delay maximum time in seconds a result stays queued
+             */
+            void set_group_commit(unsigned int max_batch, const finish_error_handler& on_error=finish_error_handler(),
+                    unsigned int max_delay=30);
+
+            /**
+             * commit all queued results (see set_group_commit).
+             *
+             * @return number of results committed successfully
+             */
+            unsigned int flush_finished();
+
             /**
              * register with the main loop
              *
@@ -79,6 +330,50 @@ namespace mdbq
              */
             void reg(boost::asio::io_service& io_service, float interval);
 
+            /**
+             * start a thread which executes the async_* operations.
+             *
+             * Once started, reg() does not block its io_service anymore:
+             * tasks are acquired on the I/O thread and handle_task() is
+             * posted to the executor, which may be run by any number of
+             * other threads.
+             *
+             * @param executor io_service which runs the completion handlers
+             */
+            void start_io_thread(boost::asio::io_service& executor);
+
+            /**
+             * finish pending asynchronous operations and stop the I/O thread.
+             */
+            void stop_io_thread();
+
+            /**
+             * acquire a new task asynchronously (see get_next_task).
+             *
+             * @param handler called on the executor when done
+             */
+            void async_get_next_task(const task_handler& handler);
+
+            /**
+             * finish the current task asynchronously (see finish).
+             *
+             * @param result a description of the result
+             * @param ok if false, task may be rescheduled by hub
+             * @param handler called on the executor when done
+             */
+            void async_finish(const mongo::BSONObj& result, bool ok, const completion_handler& handler);
+
+            /**
+             * flush logs and check for timeouts asynchronously (see checkpoint).
+             *
+             * a timeout is reported to the handler as timeout_exception,
+             * a cancellation as cancelled_exception.
+             *
+             * @param handler called on the executor when done
+             * @param check_for_timeout if false, this flushes logs even when timeout occured.
+             */
+            void async_checkpoint(const completion_handler& handler, bool check_for_timeout=true);
+
             /**
              * log a bson obj in the logs database.
              * @param level a log level
@@ -95,6 +390,63 @@ namespace mdbq
              */
             void log(int level, const char* ptr, size_t len, const mongo::BSONObj& msg);
 
+            /**
+             * record a point of a numeric curve, e.g. the training loss.
+             *
+             * points are buffered and written in buckets at the next
+             * checkpoint or finish, which is much cheaper than one log
+             * entry per point.
+             *
+             * @param name name of the curve
+             * @param step x-coordinate, e.g. the iteration
+             * @param value y-coordinate
+             */
+            void metric(const std::string& name, long long step, double value);
+
+            /**
+             * read back a curve recorded with metric().
+             *
+             * @param task the task, needs its _id
+             * @param name name of the curve
+             * @param steps receives the steps, in order of recording
+             * @param values receives the values
+             * @param from only steps from here...
+             * @param to ...up to here (inclusive)
+             * @param max_points if there are more points, return the mean
+             *        steps and values of max_points intervals of equal width
+             *        instead. Summaries of whole buckets are merged by the
+             *        server, points are only fetched for buckets at the range
+             *        bounds, or if there are fewer buckets than intervals.
+             *        0 returns all.
+             */
+            void get_metric(const mongo::BSONObj& task, const std::string& name,
+                    std::vector<long long>& steps, std::vector<double>& values,
+                    long long from=LLONG_MIN, long long to=LLONG_MAX, unsigned int max_points=0);
+
+            /**
+             * save the state of the current task, so that it can be resumed.
+             *
+             * the state is written with the next checkpoint and replaces
+             * the previously saved one. Large states are stored in GridFS.
+             * When the task finishes successfully, its state is removed.
+             * Duplicate attempts (see set_speculative) do not save states.
+             *
+             * @param ptr the state
+             * @param len number of bytes starting at \c ptr
+             */
+            void save_state(const char* ptr, size_t len);
+
+            /**
+             * get the state saved by an earlier attempt of the current task.
+             *
+             * call this at the start of handle_task to resume a task which
+             * failed or timed out.
+             *
+             * @param state receives the state
+             * @return false if no state was saved
+             */
+            bool load_state(std::string& state);
+
             /**
              * get the log of a task (mainly for testing)
              */
@@ -103,6 +455,8 @@ namespace mdbq
             /**
              * flush logs and check for timeouts (throws timeout_exception).
              *
+             * also throws cancelled_exception if the hub cancelled the task.
+             *
              * @param check_for_timeout if false, this flushes logs even when timeout occured.
              */
             void checkpoint(bool check_for_timeout=true);
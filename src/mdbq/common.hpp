@@ -7,7 +7,8 @@ namespace mdbq
         TS_NEW,
         TS_RUNNING,
         TS_OK,
-        TS_FAILED
+        TS_FAILED,
+        TS_CANCELLED
     };
 }
 #endif /* __MDBQ_COMMON_HPP__ */
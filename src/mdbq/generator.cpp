@@ -0,0 +1,104 @@
+#include <cmath>
+#include <stdexcept>
+#include "generator.hpp"
+
+namespace mdbq
+{
+    void JobGenerator::skip(unsigned long n){
+        std::vector<mongo::BSONObj> discard;
+        while(n){
+            unsigned int batch = n < 1000 ? n : 1000;
+            discard.clear();
+            if(!produce(batch, discard))
+                return;
+            n -= batch;
+        }
+    }
+
+    GridGenerator::GridGenerator(const mongo::BSONObj& axes, const mongo::BSONObj& fixed)
+        : m_axes(axes.getOwned())
+        , m_fixed(fixed.getOwned())
+        , m_size(1)
+        , m_next(0)
+    {
+        mongo::BSONObjIterator it(m_axes);
+        while(it.more()){
+            mongo::BSONElement e = it.next();
+            if(e.type() != mongo::Array)
+                throw std::runtime_error(std::string("MDBQ: grid axis `") + e.fieldName() + "' is not an array");
+            m_names.push_back(e.fieldName());
+            m_values.push_back(e.Array());
+            m_size *= m_values.back().size();
+        }
+    }
+
+    bool GridGenerator::produce(unsigned int n, std::vector<mongo::BSONObj>& jobs){
+        for(; n && m_next < m_size; n--, m_next++){
+            mongo::BSONObjBuilder bob;
+            bob.appendElements(m_fixed);
+            // mixed-radix digits of m_next, the last axis varies fastest
+            std::vector<size_t> idx(m_names.size());
+            unsigned long rest = m_next;
+            for(size_t i = m_names.size(); i-- > 0; ){
+                idx[i] = rest % m_values[i].size();
+                rest  /= m_values[i].size();
+            }
+            for(size_t i = 0; i < m_names.size(); i++)
+                bob.appendAs(m_values[i][idx[i]], m_names[i]);
+            jobs.push_back(bob.obj());
+        }
+        return m_next < m_size;
+    }
+
+    void GridGenerator::skip(unsigned long n){
+        m_next = std::min(m_size, m_next + n);
+    }
+
+    RandomSweepGenerator::RandomSweepGenerator(const mongo::BSONObj& space, unsigned long n_jobs, unsigned int seed)
+        : m_space(space.getOwned())
+        , m_n_jobs(n_jobs)
+        , m_next(0)
+        , m_rng(seed)
+    {
+    }
+
+    double RandomSweepGenerator::uniform(){
+        // 32 random bits are plenty, and the sequence is the same everywhere
+        return m_rng() / 4294967296.;
+    }
+
+    mongo::BSONObj RandomSweepGenerator::sample(){
+        mongo::BSONObjBuilder bob;
+        mongo::BSONObjIterator it(m_space);
+        while(it.more()){
+            mongo::BSONElement e = it.next();
+            if(e.type() == mongo::Array){
+                std::vector<mongo::BSONElement> choices = e.Array();
+                if(choices.empty())
+                    throw std::runtime_error(std::string("MDBQ: no choices for `") + e.fieldName() + "'");
+                size_t i = std::min(choices.size() - 1, (size_t)(uniform() * choices.size()));
+                bob.appendAs(choices[i], e.fieldName());
+            }else if(e.type() == mongo::Object && e.Obj().hasField("min") && e.Obj().hasField("max")){
+                mongo::BSONObj r = e.Obj();
+                double lo = r["min"].Number(), hi = r["max"].Number(), v;
+                if(r["log"].trueValue())
+                    v = std::exp(std::log(lo) + uniform() * (std::log(hi) - std::log(lo)));
+                else
+                    v = lo + uniform() * (hi - lo);
+                if(r["int"].trueValue())
+                    bob.append(e.fieldName(), (long long)std::floor(v));
+                else
+                    bob.append(e.fieldName(), v);
+            }else{
+                bob.append(e);
+            }
+        }
+        return bob.obj();
+    }
+
+    bool RandomSweepGenerator::produce(unsigned int n, std::vector<mongo::BSONObj>& jobs){
+        for(; n && (!m_n_jobs || m_next < m_n_jobs); n--, m_next++)
+            jobs.push_back(sample());
+        return !m_n_jobs || m_next < m_n_jobs;
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef __MDBQ_GENERATOR_HPP__
+#     define __MDBQ_GENERATOR_HPP__
+
+#include <string>
+#include <vector>
+#include <boost/random/mersenne_twister.hpp>
+#include <mongo/client/dbclient.h>
+
+namespace mdbq
+{
+    /**
+     * produces job descriptions on demand (see Hub::add_generator).
+     *
+     * derive from this class to generate jobs lazily, so that the jobs
+     * collection only holds the next few jobs of a large sweep.
+     */
+    class JobGenerator{
+        public:
+            /**
+             * append up to n job descriptions to jobs.
+             *
+             * @return false if the generator is exhausted
+             */
+            virtual bool produce(unsigned int n, std::vector<mongo::BSONObj>& jobs)=0;
+
+            /**
+             * skip the next n jobs, used to continue after a restart of the hub.
+             *
+             * the default produces and discards them.
+             */
+            virtual void skip(unsigned long n);
+
+            virtual ~JobGenerator(){}
+    };
+
+    /**
+     * all combinations of the values of some parameters.
+     *
+     * @code
+     * GridGenerator g(BSON("lr" << BSON_ARRAY(0.1 << 0.01) << "depth" << BSON_ARRAY(2 << 3 << 4)));
+     * // {lr: 0.1, depth: 2}, {lr: 0.1, depth: 3}, ..., {lr: 0.01, depth: 4}
+     * @endcode
+     */
+    class GridGenerator : public JobGenerator{
+        public:
+            /**
+             * @param axes an array of values for each parameter, the last one varies fastest
+             * @param fixed added to every job
+             */
+            GridGenerator(const mongo::BSONObj& axes, const mongo::BSONObj& fixed=mongo::BSONObj());
+            bool produce(unsigned int n, std::vector<mongo::BSONObj>& jobs);
+            void skip(unsigned long n);
+            /// number of jobs in the grid
+            unsigned long size()const{ return m_size; }
+        private:
+            std::vector<std::string> m_names;
+            std::vector<std::vector<mongo::BSONElement> > m_values;
+            mongo::BSONObj m_axes;
+            mongo::BSONObj m_fixed;
+            unsigned long m_size;
+            unsigned long m_next;
+    };
+
+    /**
+     * random samples from a parameter space.
+     *
+     * each field of the space is either
+     * - an array, which is sampled uniformly,
+     * - a document {min: a, max: b}, sampled uniformly from [a, b), with
+     *   optional flags log (sample log-uniformly) and int (round down), or
+     * - any other value, which is copied into every job.
+     *
+     * @code
+     * RandomSweepGenerator g(BSON(
+     *     "lr"    << BSON("min" << 1e-5 << "max" << 1e-1 << "log" << true) <<
+     *     "depth" << BSON("min" << 2 << "max" << 10 << "int" << true) <<
+     *     "act"   << BSON_ARRAY("relu" << "tanh")), 100000);
+     * @endcode
+     */
+    class RandomSweepGenerator : public JobGenerator{
+        public:
+            /**
+             * @param space the parameter space
+             * @param n_jobs number of samples, 0 for an endless sweep
+             * @param seed the same seed produces the same sweep
+             */
+            RandomSweepGenerator(const mongo::BSONObj& space, unsigned long n_jobs, unsigned int seed=42);
+            bool produce(unsigned int n, std::vector<mongo::BSONObj>& jobs);
+        private:
+            mongo::BSONObj sample();
+            double uniform();
+            mongo::BSONObj m_space;
+            unsigned long m_n_jobs;
+            unsigned long m_next;
+            boost::mt19937 m_rng;
+    };
+}
+#endif /* __MDBQ_GENERATOR_HPP__ */
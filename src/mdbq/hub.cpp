@@ -1,10 +1,20 @@
-#include <iomanip>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <set>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <mongo/client/dbclient.h>
+#include <mongo/client/gridfs.h>
 #include "common.hpp"
 #include "hub.hpp"
 #include "date_time.hpp"
+#include "io_thread.hpp"
+#include "metrics.hpp"
+#include "blob.hpp"
+#include "generator.hpp"
 
 #ifdef NDEBUG
 #  define CHECK_DB_ERR(CON)
@@ -20,60 +30,550 @@
 
 namespace mdbq
 {
+    /// number of partitions jobs are spread over for maintenance
+    static const int N_PARTITIONS = 1024;
+
     struct HubImpl{
         mongo::DBClientConnection m_con;
+        boost::scoped_ptr<mongo::GridFS> m_fs;
 
         unsigned int m_interval;
         std::string  m_prefix;
+        unsigned int m_archive_age;
+        unsigned int m_archive_batch;
+        std::string  m_metrics_path;
+        MetricsFormat m_metrics_format;
+        unsigned int m_metrics_every;
+        unsigned int m_runtime_window;
+        unsigned int m_ticks;
+        unsigned int m_reconcile_ticks;
+        size_t       m_offload_threshold;
+        mongo::OID   m_hub_id;   ///< our lease in the hubs collection
+        unsigned int m_n_hubs;   ///< number of live hubs at the last tick
+        unsigned int m_rank;     ///< our position among them, 0 is the leader
+        std::map<int, unsigned int> m_log_retention; ///< maximum age of log entries by level
+        unsigned int m_log_thin_after;
+        unsigned int m_log_keep_every;
+        bool         m_orphan_cleanup;
+        mongo::BSONObj m_orphan_pos;  ///< last GridFS file checked for orphans
+
+        /// a generator and how to insert its jobs
+        struct GeneratorEntry{
+            std::string                     name;
+            boost::shared_ptr<JobGenerator> gen;
+            unsigned int                    timeout;
+            std::string                     driver;
+            mongo::BSONObj                  resources;
+            std::string                     affinity;
+            unsigned long long              next;      ///< position of the next job in the sweep
+            bool                            done;
+        };
+        std::vector<GeneratorEntry> m_generators;
+        unsigned int m_low_water;
+        unsigned int m_high_water;
         std::auto_ptr<boost::asio::deadline_timer> m_timer;
-        void print_current_job_summary(Hub* c, const boost::system::error_code& error){
+
+        /// serializes access to m_con once the I/O thread runs
+        boost::recursive_mutex    m_mutex;
+        boost::asio::io_service*  m_executor;
+        bool                      m_busy;
+        IoThread                  m_io; // declared last: joined before the rest is destroyed
+
+        HubImpl()
+            : m_archive_age(0)
+            , m_archive_batch(1000)
+            , m_metrics_format(MF_PROMETHEUS)
+            , m_metrics_every(1)
+            , m_runtime_window(1000)
+            , m_ticks(0)
+            , m_reconcile_ticks(0)
+            , m_offload_threshold(0)
+            , m_hub_id(mongo::OID::gen())
+            , m_n_hubs(1)
+            , m_rank(0)
+            , m_log_thin_after(0)
+            , m_log_keep_every(1)
+            , m_orphan_cleanup(false)
+            , m_low_water(0)
+            , m_high_water(0)
+            , m_executor(NULL)
+            , m_busy(false)
+        {}
+
+        mongo::BSONObj make_job(const mongo::BSONObj& job, unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+                const std::string& affinity){
+            boost::posix_time::ptime ctime = universal_date_time();
+            // the id is needed up front to tag offloaded fields
+            mongo::BSONObj id = BSON("_id" << mongo::OID::gen());
+            mongo::BSONObj misc = offload_fields(*m_fs, m_con, m_prefix+".fs",
+                    job, id["_id"], m_offload_threshold);
+            mongo::BSONObjBuilder bob;
+            bob.appendElements(id);
+            bob.appendElements(BSON( "timeout"     << timeout
+                    <<"exp_key"     << driver
+                    <<"create_time" << to_mongo_date(ctime)
+                    <<"finish_time" << mongo::Undefined
+                    <<"book_time"   << mongo::Undefined
+                    <<"refresh_time"<< mongo::Undefined
+                    <<"misc"        << misc
+                    <<"nfailed"     << (int)0
+                    <<"state"       << TS_NEW
+                    <<"result"      << BSON("status"<<"new")
+                    <<"version"     << (int)0
+                    <<"part"        << (int)(drand48() * N_PARTITIONS)
+                    ));
+            if(!resources.isEmpty()){
+                // the keys allow clients to skip jobs needing resources they do not have
+                mongo::BSONArrayBuilder keys;
+                mongo::BSONObjIterator it(resources);
+                while(it.more())
+                    keys.append(it.next().fieldName());
+                bob.append("resources", resources);
+                bob.append("resource_keys", keys.arr());
+            }
+            if(!affinity.empty())
+                bob.append("affinity", affinity);
+            return bob.obj();
+        }
+
+        /**
+         * insert jobs.
+         *
+         * @param generator name of the generator which produced the jobs,
+         *        empty for jobs inserted directly. Generated jobs are
+         *        tagged with the generator and their position in its
+         *        sweep, positions which exist already are skipped.
+         * @param first position of the first job in the sweep
+         */
+        void insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+                const std::string& affinity, const std::string& generator="", unsigned long long first=0){
+            boost::recursive_mutex::scoped_lock lock(m_mutex);
+            std::set<long long> existing;
+            if(!generator.empty() && !jobs.empty()){
+                mongo::BSONObj fields = BSON("_id" << 0 << "gen_index" << 1);
+                std::auto_ptr<mongo::DBClientCursor> p = m_con.query(m_prefix+".jobs",
+                        BSON("generator" << generator <<
+                             "gen_index" << BSON("$gte" << (long long)first << "$lt" << (long long)(first + jobs.size()))),
+                        0, 0, &fields);
+                while(p->more())
+                    existing.insert(p->next()["gen_index"].numberLong());
+            }
+            std::vector<mongo::BSONObj> docs;
+            docs.reserve(jobs.size());
+            for(unsigned int i = 0; i < jobs.size(); i++){
+                if(generator.empty()){
+                    docs.push_back(make_job(jobs[i], timeout, driver, resources, affinity));
+                    continue;
+                }
+                long long idx = first + i;
+                if(existing.count(idx))
+                    continue;
+                mongo::BSONObjBuilder bob;
+                bob.appendElements(make_job(jobs[i], timeout, driver, resources, affinity));
+                bob.append("generator", generator);
+                bob.append("gen_index", idx);
+                docs.push_back(bob.obj());
+            }
+            if(docs.empty())
+                return;
+            m_con.insert(m_prefix+".jobs", docs);
+            CHECK_DB_ERR(m_con);
+            count_open(driver, docs.size());
+        }
+
+        /**
+         * indexes of the per-state queries of the hub, i.e. metrics,
+         * archival and the watermark checks, and of the rescheduled
+         * count of the metrics.
+         */
+        void ensure_job_indexes(){
+            m_con.ensureIndex(m_prefix+".jobs", BSON("state"<<1 << "exp_key"<<1));
+            m_con.ensureIndex(m_prefix+".jobs", BSON("state"<<1 << "create_time"<<1));
+            m_con.ensureIndex(m_prefix+".jobs", BSON("state"<<1 << "finish_time"<<1));
+            m_con.ensureIndex(m_prefix+".jobs", BSON("nfailed"<<1));
+            // a generated job exists only once, also if its batch is produced again
+            mongo::BSONObj res;
+            if(!m_con.runCommand(m_prefix, BSON("createIndexes" << "jobs" << "indexes" << BSON_ARRAY(
+                                BSON("key" << BSON("generator" << 1 << "gen_index" << 1) <<
+                                     "name" << "generator_sweep" <<
+                                     "unique" << true <<
+                                     "sparse" << true))), res))
+                throw std::runtime_error("HUB: creating generator index failed: " + res.toString());
+        }
+
+        /// keep the pending counter of an experiment (fair-share scheduling) up to date
+        void count_open(const std::string& exp_key, int n){
+            m_con.update(m_prefix+".experiments",
+                    QUERY("_id" << exp_key),
+                    BSON("$inc" << BSON("open" << n) <<
+                         "$setOnInsert" << BSON("pass" << min_active_pass())), true);
+        }
+
+        /**
+         * the smallest pass of the experiments with pending or running jobs.
+         *
+         * new experiments start here, a smaller pass would give them all
+         * claims until they caught up with the others.
+         */
+        double min_active_pass(){
+            mongo::BSONObj fields = BSON("pass" << 1);
+            mongo::BSONObj e = m_con.findOne(m_prefix+".experiments",
+                    mongo::Query(BSON("$or" << BSON_ARRAY(
+                                BSON("open"    << mongo::GT << 0) <<
+                                BSON("running" << mongo::GT << 0)) <<
+                            "pass" << BSON("$exists" << true))).sort("pass"), &fields);
+            return e["pass"].isNumber() ? e["pass"].Number() : 0.;
+        }
+
+        /**
+         * correct the fair-share counters of all experiments.
+         *
+         * clients and hubs adjust the counters as they go, this fixes
+         * drift from crashed clients. It looks at every pending and
+         * running job, so the leader only runs it every
+         * reconcile_every ticks. Idle
+         * experiments are moved forward to the pass of the active ones,
+         * so that they do not monopolize the queue when they become
+         * active again.
+         */
+        void reconcile_experiments(){
+            static const unsigned int reconcile_every = 10;
+            if(m_reconcile_ticks++ % reconcile_every)
+                return;
+            mongo::BSONObj res;
+            if(!m_con.runCommand(m_prefix, BSON("aggregate" << "jobs" << "pipeline" << BSON_ARRAY(
+                            BSON("$match" << BSON("state" << BSON("$in" << BSON_ARRAY(TS_NEW << TS_RUNNING)))) <<
+                            BSON("$group" << BSON(
+                                    "_id"     << "$exp_key" <<
+                                    "open"    << BSON("$sum" << BSON("$cond" << BSON_ARRAY(
+                                                BSON("$eq" << BSON_ARRAY("$state" << TS_NEW)) << 1 << 0))) <<
+                                    "running" << BSON("$sum" << BSON("$cond" << BSON_ARRAY(
+                                                BSON("$eq" << BSON_ARRAY("$state" << TS_RUNNING)) << 1 << 0))))))), res))
+                throw std::runtime_error("HUB: experiment aggregation failed: " + res.toString());
+
+            std::vector<mongo::BSONElement> groups = res["result"].Array();
+            mongo::BSONArrayBuilder active;
+            double pass = min_active_pass();
+            for(unsigned int i = 0; i < groups.size(); i++){
+                mongo::BSONObj g = groups[i].Obj();
+                active.append(g["_id"]);
+                m_con.update(m_prefix+".experiments",
+                        QUERY("_id" << g["_id"]),
+                        BSON("$set" << BSON("open" << g["open"].numberInt() << "running" << g["running"].numberInt()) <<
+                             "$setOnInsert" << BSON("pass" << pass)),
+                        true);
+            }
+            m_con.update(m_prefix+".experiments",
+                    BSON("_id" << BSON("$nin" << active.arr())),
+                    BSON("$set" << BSON("open" << 0 << "running" << 0)),
+                    false, true);
+
+            mongo::BSONObj fields = BSON("pass" << 1);
+            mongo::BSONObj busiest = m_con.findOne(m_prefix+".experiments",
+                    QUERY("running" << mongo::GT << 0).sort("pass"), &fields);
+            if(!busiest.isEmpty() && busiest["pass"].isNumber())
+                m_con.update(m_prefix+".experiments",
+                        QUERY("running" << 0 << "pass" << mongo::LT << busiest["pass"].Number()),
+                        BSON("$set" << BSON("pass" << busiest["pass"].Number())),
+                        false, true);
+            CHECK_DB_ERR(m_con);
+        }
+
+        /**
+         * renew our lease and determine which partitions we own.
+         *
+         * hubs on the same prefix split maintenance by the part field
+         * of the jobs. A hub which stops renewing its lease is removed
+         * by the others, and its partitions are taken over at their
+         * next tick.
+         */
+        void renew_lease(){
+            boost::posix_time::ptime now = universal_date_time();
+            unsigned int lease = 3 * std::max(m_interval, 1u);
+            m_con.update(m_prefix+".hubs",
+                    QUERY("_id" << m_hub_id),
+                    BSON("$set" << BSON("expires" << to_mongo_date(now + boost::posix_time::seconds(lease)))),
+                    true);
+            m_con.remove(m_prefix+".hubs",
+                    QUERY("expires" << mongo::LT << to_mongo_date(now)));
+            CHECK_DB_ERR(m_con);
+
+            mongo::BSONObj fields = BSON("_id" << 1);
             std::auto_ptr<mongo::DBClientCursor> p =
-                // note: currently snapshot mode may not be used w/ sorting or explicit hints
-                m_con.query( m_prefix+".jobs", 
-                        QUERY( "state"   << mongo::GT<< -1));
+                m_con.query(m_prefix+".hubs", mongo::Query().sort("_id"), 0, 0, &fields);
+            unsigned int n = 0, rank = 0;
+            while(p->more()){
+                if(p->next()["_id"].OID() == m_hub_id)
+                    rank = n;
+                n++;
+            }
+            m_n_hubs = std::max(n, 1u);
+            m_rank   = rank;
+        }
+
+        /// the jobs this hub is responsible for, the leader also takes jobs inserted before partitioning
+        mongo::BSONObj owned_jobs()const{
+            mongo::BSONObj mine = BSON("part" << BSON("$mod" << BSON_ARRAY((int)m_n_hubs << (int)m_rank)));
+            if(m_rank)
+                return mine;
+            return BSON("$or" << BSON_ARRAY(mine << BSON("part" << BSON("$exists" << false))));
+        }
+
+        /// remove log entries and their GridFS files
+        void remove_log(const mongo::BSONObj& q){
+            // files first, so an interruption leaves no dangling references
+            mongo::BSONObjBuilder fq;
+            fq.appendElements(q);
+            fq.append("filename", BSON("$exists" << true));
+            mongo::BSONObj fields = BSON("filename" << 1);
+            std::auto_ptr<mongo::DBClientCursor> p =
+                m_con.query(m_prefix+".log", fq.obj(), 0, 0, &fields);
+            while(p->more())
+                m_fs->removeFile(p->next()["filename"].String());
+            m_con.remove(m_prefix+".log", q);
             CHECK_DB_ERR(m_con);
+        }
 
-            std::cout << "JOB SUMMARY" << std::endl;
-            std::cout << "===========" << std::endl
-                    << "Type    : "
-                    << std::setw(8)<<"state"
-                    << std::setw(8) <<"nfailed"
-                    << std::setw(10) <<"owner"
-                    << std::setw(16) <<"create_time"
-                    << std::setw(16)<<"book_time"
-                    << std::setw(16)<<"finish_time"
-                    << std::setw(16)<<"deadline"
-                    << std::setw(16)<<"misc"
-                    << std::endl;
+        /**
+         * enforce log retention and downsampling.
+         *
+         * downsampling keeps entries whose nr is a multiple of
+         * m_log_keep_every, so it is idempotent. Entries with files
+         * are always kept.
+         */
+        void sweep_log(){
+            boost::posix_time::ptime now = universal_date_time();
+            for(std::map<int, unsigned int>::const_iterator it = m_log_retention.begin();
+                    it != m_log_retention.end(); ++it)
+                remove_log(BSON("level" << it->first <<
+                            "timestamp" << BSON("$lt" << to_mongo_date(now - boost::posix_time::seconds(it->second)))));
+
+            if(m_log_thin_after && m_log_keep_every > 1){
+                m_con.remove(m_prefix+".log", BSON(
+                            "timestamp" << BSON("$lt" << to_mongo_date(now - boost::posix_time::seconds(m_log_thin_after))) <<
+                            "filename"  << BSON("$exists" << false) <<
+                            "nr"        << BSON("$not" << BSON("$mod" << BSON_ARRAY((int)m_log_keep_every << 0)))));
+                CHECK_DB_ERR(m_con);
+            }
+        }
+
+        /**
+         * remove GridFS files (logs and offloaded fields) whose task is gone.
+         *
+         * checks one batch of files per call and continues where it
+         * left off at the next call.
+         */
+        void remove_orphans(unsigned int batch){
+            if(!m_orphan_cleanup)
+                return;
+            // files are written before the job or log entry referring to them
+            static const unsigned int grace = 3600;
+            mongo::BSONObjBuilder qb;
+            qb.append("taskid", BSON("$exists" << true));
+            qb.append("uploadDate", BSON("$lt" << to_mongo_date(universal_date_time() - boost::posix_time::seconds(grace))));
+            if(!m_orphan_pos.isEmpty())
+                qb.append("_id", BSON("$gt" << m_orphan_pos["_id"]));
+            mongo::BSONObj fields = BSON("_id" << 1 << "taskid" << 1 << "filename" << 1);
+            std::auto_ptr<mongo::DBClientCursor> p =
+                m_con.query(m_prefix+".fs.files", mongo::Query(qb.obj()).sort("_id"), batch, 0, &fields);
+            std::vector<mongo::BSONObj> files;
+            mongo::BSONArrayBuilder taskids;
             while(p->more()){
-                mongo::BSONObj f = p->next();
-                if(f.isEmpty())
+                files.push_back(p->next().getOwned());
+                taskids.append(files.back()["taskid"]);
+            }
+            if(files.empty()){
+                m_orphan_pos = mongo::BSONObj(); // start over
+                return;
+            }
+            m_orphan_pos = files.back();
+
+            std::set<std::string> alive;
+            mongo::BSONObj q = BSON("_id" << BSON("$in" << taskids.arr()));
+            mongo::BSONObj idonly = BSON("_id" << 1);
+            const char* cols[] = {".jobs", ".jobs_archive"};
+            for(unsigned int c = 0; c < 2; c++){
+                std::auto_ptr<mongo::DBClientCursor> t =
+                    m_con.query(m_prefix+cols[c], q, 0, 0, &idonly);
+                while(t->more())
+                    alive.insert(t->next()["_id"].toString(false));
+            }
+            for(unsigned int i = 0; i < files.size(); i++)
+                if(!alive.count(files[i]["taskid"].toString(false)))
+                    m_fs->removeFile(files[i]["filename"].String());
+            CHECK_DB_ERR(m_con);
+        }
+
+        /// let the hub produce jobs if the queue runs low
+        void refill(Hub* c){
+            if(!m_high_water)
+                return;
+            unsigned long long depth = m_con.count(m_prefix+".jobs", BSON("state" << TS_NEW));
+            if(depth >= m_low_water)
+                return;
+            c->produce(m_high_water - depth);
+        }
+
+        /**
+         * insert up to n jobs from the generators, in order of registration.
+         *
+         * the number of jobs produced is stored with the generator's name,
+         * so that a restarted hub continues where it left off. Jobs are
+         * tagged with the generator's name and their position in the
+         * sweep, so a batch which is produced again because the hub
+         * stopped before storing the progress is not inserted twice.
+         */
+        void produce_from_generators(unsigned int n){
+            for(unsigned int i = 0; i < m_generators.size() && n; i++){
+                GeneratorEntry& e = m_generators[i];
+                if(e.done)
                     continue;
-                std::cout << "ASSIGNED: "
-                    << std::setw(8) <<f["state"].Int()
-                    << std::setw(8) <<f["nfailed"].Int()
-                    << std::setw(10) <<f["owner"].Array()[0].String()
-                    << std::setw(16)<<dt_format(to_ptime(f["create_time"].Date()))
-                    << std::setw(16)<<dt_format(to_ptime(f["book_time"].Date()))
-                    << std::setw(16)<<dt_format(to_ptime(f["finish_time"].Date()))
-                    << std::setw(16)<<dt_format(to_ptime(f["book_time"].Date())+boost::posix_time::seconds(f["timeout"].Int()))
-                    << " " << f["misc"]
-                    << std::endl;
+                // another hub may have continued the sweep while it was the leader
+                mongo::BSONObj progress = m_con.findOne(m_prefix+".generators", QUERY("_id" << e.name));
+                if(progress["done"].trueValue()){
+                    e.done = true;
+                    continue;
+                }
+                unsigned long long produced = progress["produced"].numberLong();
+                if(produced > e.next){
+                    e.gen->skip(produced - e.next);
+                    e.next = produced;
+                }
+
+                std::vector<mongo::BSONObj> jobs;
+                bool more = e.gen->produce(n, jobs);
+                insert_jobs(jobs, e.timeout, e.driver, e.resources, e.affinity, e.name, e.next);
+                e.next += jobs.size();
+                e.done  = !more;
+                m_con.update(m_prefix+".generators",
+                        QUERY("_id" << e.name),
+                        BSON("$set" << BSON("produced" << (long long)e.next << "done" << e.done)),
+                        true);
+                CHECK_DB_ERR(m_con);
+                n -= std::min((size_t)n, jobs.size());
             }
         }
+
+        void drop_lease(){
+            m_con.remove(m_prefix+".hubs", QUERY("_id" << m_hub_id));
+        }
+
+        void do_insert_jobs(std::vector<mongo::BSONObj> jobs, unsigned int timeout, std::string driver, std::string affinity, completion_handler handler){
+            boost::exception_ptr err;
+            try{
+                insert_jobs(jobs, timeout, driver, mongo::BSONObj(), affinity);
+            }catch(...){
+                err = capture_exception();
+            }
+            m_executor->post(boost::bind(handler, err));
+        }
+
+        /**
+         * move one batch of old finished jobs to the archive.
+         *
+         * documents are first copied, then removed from the jobs
+         * collection. If we are interrupted in between, the next call
+         * copies the same documents again (duplicates are ignored) and
+         * removes them.
+         */
+        void archive_finished(){
+            if(!m_archive_age)
+                return;
+            mongo::Date_t cutoff = to_mongo_date(universal_date_time() 
+                    - boost::posix_time::seconds(m_archive_age));
+            mongo::BSONObj q = BSON("$and" << BSON_ARRAY(owned_jobs() << BSON("$or" << BSON_ARRAY(
+                        BSON("state" << TS_OK <<
+                             "finish_time" << mongo::LT << cutoff) <<
+                        BSON("state" << TS_FAILED <<
+                             "nfailed" << mongo::GTE << 1 <<  /* not rescheduled again */
+                             "failure_time" << mongo::LT << cutoff)))));
+
+            std::auto_ptr<mongo::DBClientCursor> p =
+                m_con.query(m_prefix+".jobs", q, m_archive_batch);
+            CHECK_DB_ERR(m_con);
+            std::vector<mongo::BSONObj> docs;
+            mongo::BSONArrayBuilder ids;
+            while(p->more()){
+                mongo::BSONObj f = p->next().getOwned();
+                ids.append(f["_id"]);
+                docs.push_back(f);
+            }
+            if(docs.empty())
+                return;
+
+            m_con.insert(m_prefix+".jobs_archive", docs, mongo::InsertOption_ContinueOnError);
+            // we must not remove anything which was not archived, so
+            // check regardless of NDEBUG. 11000 is a duplicate key,
+            // i.e. a job archived by an interrupted previous batch.
+            mongo::BSONObj err = m_con.getLastErrorDetailed();
+            if(!err["err"].isNull() && err["code"].numberInt() != 11000)
+                throw std::runtime_error("HUB: archiving failed: " + err.toString());
+
+            m_con.remove(m_prefix+".jobs", 
+                    BSON("_id" << BSON("$in" << ids.arr())));
+            CHECK_DB_ERR(m_con);
+        }
+        void export_metrics(){
+            if(m_metrics_path.empty() || ++m_ticks % m_metrics_every)
+                return;
+            mongo::BSONObj m = collect_metrics(m_con, m_prefix, m_runtime_window);
+            if(m_metrics_format == MF_JSON)
+                write_file_atomically(m_metrics_path, m.jsonString());
+            else
+                write_file_atomically(m_metrics_path, metrics_to_prometheus(m));
+        }
+
+        /// runs maintenance on the I/O thread, skipped while the previous run is busy
+        void post_maintenance(Hub* c){
+            {
+                boost::recursive_mutex::scoped_lock lock(m_mutex);
+                if(m_busy)
+                    return;
+                m_busy = true;
+            }
+            m_io.post(boost::bind(&HubImpl::do_maintenance, this, c));
+        }
+
+        void do_maintenance(Hub* c){
+            try{
+                maintenance(c);
+            }catch(std::exception& e){
+                std::cerr << "HUB: warning: maintenance failed: " << e.what() << std::endl;
+            }
+            boost::recursive_mutex::scoped_lock lock(m_mutex);
+            m_busy = false;
+        }
+
         void update_check(Hub* c, const boost::system::error_code& error){
-            //print_current_job_summary(c,error);
+            if(m_io.running())
+                post_maintenance(c);
+            else
+                maintenance(c);
+
+            if(!error){
+                m_timer->expires_at(m_timer->expires_at() + boost::posix_time::seconds(m_interval));
+                m_timer->async_wait(boost::bind(&HubImpl::update_check,this,c,boost::asio::placeholders::error));
+            }else{
+                throw std::runtime_error("HUB: error_code!=0, failing!");
+            }
+        }
+
+        void maintenance(Hub* c){
+            boost::recursive_mutex::scoped_lock lock(m_mutex);
+            renew_lease();
 
             // search for jobs which have failed and reschedule them
             mongo::BSONObj ret = BSON("_id"<<1 << 
                            "owner"<<1 <<
-                           "nfailed"<<1);
+                           "nfailed"<<1 <<
+                           "exp_key"<<1);
+            mongo::BSONObjBuilder qb;
+            qb.append("state", TS_FAILED);
+            qb.append("nfailed", BSON("$lt" << 1)); /* first time failure only */
+            qb.append("cancelled", BSON("$ne" << true));
+            qb.appendElements(owned_jobs());
             std::auto_ptr<mongo::DBClientCursor> p =
-               m_con.query( m_prefix+".jobs", 
-                       QUERY(
-                           "state" << TS_FAILED <<
-                           "nfailed" << mongo::LT << 1), /* first time failure only */
-                       0,0,&ret);
+               m_con.query( m_prefix+".jobs", qb.obj(), 0,0,&ret);
             CHECK_DB_ERR(m_con);
             while(p->more()){
                 mongo::BSONObj f = p->next();
@@ -84,22 +584,40 @@ namespace mdbq
                     << f["_id"] << "' on `"
                     << f["owner"].String() << "' failed, rescheduling"<<std::endl;
 
+                // only if nobody else rescheduled it in the meantime,
+                // e.g. a hub which did not notice that ownership moved
                 m_con.update(m_prefix+".jobs", 
-                        QUERY("_id"<<f["_id"]), 
+                        QUERY("_id"<<f["_id"] << "state"<<TS_FAILED << "nfailed"<<f["nfailed"]), 
                         BSON(
                             "$inc" << BSON("nfailed"<<1)<<
+                            "$unset" << BSON("spec_owner"<<1)<<
                             "$set" << BSON(
                                 "state"         << TS_NEW 
                                 <<"book_time"   << mongo::Undefined
                                 <<"refresh_time"<< mongo::Undefined)));
+                if(m_con.getLastErrorDetailed()["n"].numberInt() == 1)
+                    count_open(f["exp_key"].str(), 1);
                 CHECK_DB_ERR(m_con);
             }
 
-            if(!error){
-                m_timer->expires_at(m_timer->expires_at() + boost::posix_time::seconds(m_interval));
-                m_timer->async_wait(boost::bind(&HubImpl::update_check,this,c,boost::asio::placeholders::error));
-            }else{
-                throw std::runtime_error("HUB: error_code!=0, failing!");
+            // cancelled jobs whose client failed before noticing
+            mongo::BSONObjBuilder cb;
+            cb.append("state", TS_FAILED);
+            cb.append("cancelled", true);
+            cb.appendElements(owned_jobs());
+            m_con.update(m_prefix+".jobs", cb.obj(),
+                    BSON("$set" << BSON("state" << TS_CANCELLED)),
+                    false, true);
+            CHECK_DB_ERR(m_con);
+
+            archive_finished();
+            if(m_rank == 0){
+                // these look at the whole queue
+                refill(c);
+                reconcile_experiments();
+                sweep_log();
+                remove_orphans(m_archive_batch);
+                export_metrics();
             }
         }
     };
@@ -111,51 +629,254 @@ namespace mdbq
         m_ptr->m_con.connect(url);
         m_ptr->m_con.createCollection(prefix+".jobs");
         m_ptr->m_prefix = prefix;
+        m_ptr->m_fs.reset(new mongo::GridFS(m_ptr->m_con, prefix, "fs"));
+        m_ptr->ensure_job_indexes();
     }
 
     void Hub::insert_job(const mongo::BSONObj& job, unsigned int timeout, const std::string& driver){
-        boost::posix_time::ptime ctime = universal_date_time();
-        m_ptr->m_con.insert(m_prefix+".jobs", 
-                BSON( mongo::GENOID
-                    <<"timeout"     << timeout
-                    <<"exp_key"     << driver
-                    <<"create_time" << to_mongo_date(ctime)
-                    <<"finish_time" << mongo::Undefined
-                    <<"book_time"   << mongo::Undefined
-                    <<"refresh_time"<< mongo::Undefined
-                    <<"misc"        << job
-                    <<"nfailed"     << (int)0
-                    <<"state"       << TS_NEW
-                    <<"result"      << BSON("status"<<"new")
-                    <<"version"     << (int)0
-                    )
-                );
+        insert_job(job, timeout, driver, mongo::BSONObj());
+    }
+    void Hub::insert_job(const mongo::BSONObj& job, unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+            const std::string& affinity){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_con.insert(m_prefix+".jobs", m_ptr->make_job(job, timeout, driver, resources, affinity));
         CHECK_DB_ERR(m_ptr->m_con);
+        m_ptr->count_open(driver, 1);
+    }
+    void Hub::insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const std::string& driver){
+        m_ptr->insert_jobs(jobs, timeout, driver, mongo::BSONObj(), "");
+    }
+    void Hub::insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+            const std::string& affinity){
+        m_ptr->insert_jobs(jobs, timeout, driver, resources, affinity);
+    }
+    void Hub::async_insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const completion_handler& handler, const std::string& driver,
+            const std::string& affinity){
+        std::vector<mongo::BSONObj> owned;
+        owned.reserve(jobs.size());
+        for(unsigned int i = 0; i < jobs.size(); i++)
+            owned.push_back(jobs[i].getOwned());
+        m_ptr->m_io.post(boost::bind(&HubImpl::do_insert_jobs, m_ptr.get(), owned, timeout, driver, affinity, handler));
+    }
+    void Hub::start_io_thread(boost::asio::io_service& executor){
+        m_ptr->m_executor = &executor;
+        m_ptr->m_io.start();
+    }
+    void Hub::stop_io_thread(){
+        m_ptr->m_io.stop();
+    }
+    Hub::~Hub(){
+        // pending maintenance refers to this object
+        m_ptr->m_io.stop();
+        if(!m_ptr->m_timer.get())
+            return;
+        try{
+            // let the remaining hubs take over our partitions right away
+            m_ptr->drop_lease();
+        }catch(std::exception& e){
+            std::cerr << "HUB: warning: could not drop lease: " << e.what() << std::endl;
+        }
     }
     size_t Hub::get_n_open(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         return m_ptr->m_con.count(m_prefix+".jobs", 
                 BSON( "state" << TS_NEW));
     }
     size_t Hub::get_n_assigned(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         return m_ptr->m_con.count(m_prefix+".jobs", 
                 BSON( "state" << TS_RUNNING));
     }
     size_t Hub::get_n_ok(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         return m_ptr->m_con.count(m_prefix+".jobs", 
+                BSON( "state" << TS_OK))
+            +  m_ptr->m_con.count(m_prefix+".jobs_archive", 
                 BSON( "state" << TS_OK));
     }
     size_t Hub::get_n_failed(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         return m_ptr->m_con.count(m_prefix+".jobs", 
+                BSON( "state" << TS_FAILED))
+            +  m_ptr->m_con.count(m_prefix+".jobs_archive", 
                 BSON( "state" << TS_FAILED));
     }
+    size_t Hub::get_n_cancelled(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        return m_ptr->m_con.count(m_prefix+".jobs", 
+                BSON( "state" << TS_CANCELLED))
+            +  m_ptr->m_con.count(m_prefix+".jobs_archive", 
+                BSON( "state" << TS_CANCELLED));
+    }
+    size_t Hub::cancel_jobs(const mongo::BSONObj& query){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        size_t n = 0;
+        {
+            // pending jobs are cancelled right away, per experiment to keep
+            // its counter of pending jobs (see set_experiment_share) right
+            mongo::BSONObjBuilder qb;
+            qb.appendElements(query);
+            qb.append("state", TS_NEW);
+            mongo::BSONObj q = qb.obj();
+            mongo::BSONObj res;
+            if(!m_ptr->m_con.runCommand(m_prefix, BSON("distinct" << "jobs" << "key" << "exp_key" << "query" << q), res))
+                throw std::runtime_error("HUB: finding experiments to cancel failed: " + res.toString());
+            std::vector<mongo::BSONElement> exps = res["values"].Array();
+            for(unsigned int i = 0; i < exps.size(); i++){
+                mongo::BSONObjBuilder eb;
+                eb.appendElements(q.removeField("exp_key"));
+                eb.appendAs(exps[i], "exp_key");
+                m_ptr->m_con.update(m_prefix+".jobs", eb.obj(),
+                        BSON("$set" << BSON("state" << TS_CANCELLED << "cancelled" << true)),
+                        false, true);
+                int ne = m_ptr->m_con.getLastErrorDetailed()["n"].numberInt();
+                if(ne && exps[i].type() == mongo::String)
+                    m_ptr->count_open(exps[i].String(), -ne);
+                n += ne;
+            }
+            // jobs without an experiment
+            m_ptr->m_con.update(m_prefix+".jobs", q,
+                    BSON("$set" << BSON("state" << TS_CANCELLED << "cancelled" << true)),
+                    false, true);
+            n += m_ptr->m_con.getLastErrorDetailed()["n"].numberInt();
+        }
+        {
+            // running jobs are flagged, their clients notice at the next checkpoint
+            mongo::BSONObjBuilder qb;
+            qb.appendElements(query);
+            qb.append("state", TS_RUNNING);
+            m_ptr->m_con.update(m_prefix+".jobs", qb.obj(),
+                    BSON("$set" << BSON("cancelled" << true)),
+                    false, true);
+            n += m_ptr->m_con.getLastErrorDetailed()["n"].numberInt();
+        }
+        return n;
+    }
     void Hub::clear_all(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
         m_ptr->m_con.dropCollection(m_prefix+".jobs");
+        m_ptr->m_con.dropCollection(m_prefix+".jobs_archive");
+        m_ptr->m_con.dropCollection(m_prefix+".experiments");
+        m_ptr->m_con.dropCollection(m_prefix+".hubs");
+        m_ptr->m_con.dropCollection(m_prefix+".generators");
+        m_ptr->m_con.dropCollection(m_prefix+".workers");
         m_ptr->m_con.dropCollection(m_prefix+".log");
+        m_ptr->m_con.dropCollection(m_prefix+".metrics");
         m_ptr->m_con.dropCollection(m_prefix+".fs.chunks");
         m_ptr->m_con.dropCollection(m_prefix+".fs.files");
 
         // this is from https://jira.mongodb.org/browse/SERVER-5323
         m_ptr->m_con.ensureIndex(m_prefix+".fs.chunks", BSON("files_id"<<1 << "n"<<1));
+        m_ptr->ensure_job_indexes();
+    }
+    void Hub::set_archival(unsigned int max_age, unsigned int batch_size){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_archive_age   = max_age;
+        m_ptr->m_archive_batch = batch_size;
+        if(!max_age)
+            return;
+        m_ptr->m_con.createCollection(m_prefix+".jobs_archive");
+        m_ptr->m_con.ensureIndex(m_prefix+".jobs_archive", BSON("state"<<1 << "result.loss"<<1));
+    }
+    mongo::BSONObj Hub::get_metrics(){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        return collect_metrics(m_ptr->m_con, m_prefix, m_ptr->m_runtime_window);
+    }
+    void Hub::set_metrics_export(const std::string& path, MetricsFormat format, unsigned int every, unsigned int runtime_window){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_metrics_path   = path;
+        m_ptr->m_metrics_format = format;
+        m_ptr->m_metrics_every  = std::max(every, 1u);
+        m_ptr->m_runtime_window = runtime_window;
+    }
+    void Hub::set_log_retention(int level, unsigned int max_age){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(!max_age){
+            m_ptr->m_log_retention.erase(level);
+            return;
+        }
+        m_ptr->m_log_retention[level] = max_age;
+        m_ptr->m_con.ensureIndex(m_prefix+".log", BSON("level"<<1 << "timestamp"<<1));
+    }
+    void Hub::set_log_ttl(unsigned int max_age){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        mongo::BSONObj res;
+        if(!max_age){
+            m_ptr->m_con.runCommand(m_prefix, BSON("dropIndexes" << "log" << "index" << "timestamp_ttl"), res);
+            return;
+        }
+        // change the expiry of an existing index, or create it
+        if(m_ptr->m_con.runCommand(m_prefix, BSON("collMod" << "log" << "index" <<
+                        BSON("name" << "timestamp_ttl" << "expireAfterSeconds" << (int)max_age)), res))
+            return;
+        if(!m_ptr->m_con.runCommand(m_prefix, BSON("createIndexes" << "log" << "indexes" << BSON_ARRAY(
+                            BSON("key" << BSON("timestamp" << 1) <<
+                                 "name" << "timestamp_ttl" <<
+                                 "expireAfterSeconds" << (int)max_age))), res))
+            throw std::runtime_error("HUB: creating TTL index failed: " + res.toString());
+    }
+    void Hub::set_log_downsampling(unsigned int after, unsigned int keep_every){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_log_thin_after = after;
+        m_ptr->m_log_keep_every = std::max(keep_every, 1u);
+        if(after)
+            m_ptr->m_con.ensureIndex(m_prefix+".log", BSON("timestamp"<<1));
+    }
+    void Hub::set_orphan_cleanup(bool enable){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_orphan_cleanup = enable;
+        if(enable)
+            m_ptr->m_con.ensureIndex(m_prefix+".fs.files", BSON("taskid"<<1));
+    }
+    void Hub::set_offload_threshold(size_t bytes){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        m_ptr->m_offload_threshold = bytes;
+    }
+    void Hub::set_experiment_share(const std::string& exp_key, double weight, unsigned int max_running){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(weight <= 0.)
+            throw std::runtime_error("HUB: experiment weight must be positive");
+        m_ptr->m_con.update(m_prefix+".experiments",
+                QUERY("_id" << exp_key),
+                BSON("$set" << BSON("weight" << weight << "cap" << (int)max_running) <<
+                     "$setOnInsert" << BSON("pass" << m_ptr->min_active_pass())), true);
+        CHECK_DB_ERR(m_ptr->m_con);
+    }
+    void Hub::add_generator(const std::string& name, const boost::shared_ptr<JobGenerator>& gen,
+            unsigned int timeout, const std::string& driver){
+        add_generator(name, gen, timeout, driver, mongo::BSONObj());
+    }
+    void Hub::add_generator(const std::string& name, const boost::shared_ptr<JobGenerator>& gen,
+            unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources, const std::string& affinity){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        HubImpl::GeneratorEntry e;
+        e.name      = name;
+        e.gen       = gen;
+        e.timeout   = timeout;
+        e.driver    = driver;
+        e.resources = resources.getOwned();
+        e.affinity  = affinity;
+        e.next      = 0;
+        e.done      = false;
+        // continue a sweep started by an earlier hub
+        mongo::BSONObj progress = m_ptr->m_con.findOne(m_prefix+".generators", QUERY("_id" << name));
+        if(progress["done"].trueValue())
+            e.done = true;
+        else if(progress["produced"].isNumber()){
+            e.next = progress["produced"].numberLong();
+            gen->skip(e.next);
+        }
+        m_ptr->m_generators.push_back(e);
+    }
+    void Hub::set_watermarks(unsigned int low, unsigned int high){
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        if(high < low)
+            throw std::runtime_error("HUB: high watermark below low watermark");
+        m_ptr->m_low_water  = low;
+        m_ptr->m_high_water = high;
+    }
+    void Hub::produce(unsigned int n){
+        m_ptr->produce_from_generators(n);
     }
     void Hub::got_new_results(){
         std::cout <<"New results available!"<<std::endl;
@@ -168,8 +889,16 @@ namespace mdbq
     }
 
     mongo::BSONObj Hub::get_newest_finished(){
-        return m_ptr->m_con.findOne(m_prefix+".jobs",
+        boost::recursive_mutex::scoped_lock lock(m_ptr->m_mutex);
+        mongo::BSONObj hot = m_ptr->m_con.findOne(m_prefix+".jobs",
+                QUERY("state"<<TS_OK).sort("finish_time"));
+        mongo::BSONObj old = m_ptr->m_con.findOne(m_prefix+".jobs_archive",
                 QUERY("state"<<TS_OK).sort("finish_time"));
+        if(old.isEmpty())
+            return hot;
+        if(hot.isEmpty())
+            return old;
+        return old["finish_time"].Date() < hot["finish_time"].Date() ? old : hot;
     }
 }
 
@@ -1,7 +1,10 @@
 #ifndef __MDBQ_HUB_HPP__
 #     define __MDBQ_HUB_HPP__
 
+#include <string>
+#include <vector>
 #include <boost/shared_ptr.hpp>
+#include "async.hpp"
 
 namespace mongo
 {
@@ -16,6 +19,15 @@ namespace boost{
 namespace mdbq
 {
     struct HubImpl;
+    class JobGenerator;
+
+    /**
+     * file formats for exported queue metrics
+     */
+    enum MetricsFormat{
+        MF_PROMETHEUS, ///< Prometheus text exposition format
+        MF_JSON        ///< the document returned by Hub::get_metrics
+    };
 
     /**
      * MongoDB Queue Hub
@@ -46,8 +58,75 @@ namespace mdbq
              */
             void insert_job(const mongo::BSONObj& job, unsigned int timeout, const std::string& driver="mdbq::hub");
 
+            /**
+             * insert job with resource requirements
+             * 
+             * the job is only handed out to clients whose ResourcePool
+             * has the resources available.
+             *
+             * @param job the job description
+             * @param timeout the timeout in seconds
+             * @param driver an identifier of the driver that created the job
+             * @param resources numeric requirements, e.g. BSON("mem_gb"<<16<<"cores"<<8), may be empty
+             * @param affinity e.g. the dataset the job works on. Clients using
+             *        Client::set_affinity prefer jobs whose affinity they have warm.
+             */
+            void insert_job(const mongo::BSONObj& job, unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+                    const std::string& affinity="");
+
+            /**
+             * insert many jobs at once
+             * 
+             * @param jobs the job descriptions
+             * @param timeout the timeout in seconds
+             * @param driver an identifier of the driver that created the jobs
+             */
+            void insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const std::string& driver="mdbq::hub");
+
+            /**
+             * insert many jobs with the same resource requirements at once
+             * 
+             * @param jobs the job descriptions
+             * @param timeout the timeout in seconds
+             * @param driver an identifier of the driver that created the jobs
+             * @param resources numeric requirements of each job (see insert_job)
+             * @param affinity affinity key of each job (see insert_job)
+             */
+            void insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+                    const std::string& affinity="");
+
+            /**
+             * insert many jobs asynchronously (see insert_jobs)
+             * 
+             * @param jobs the job descriptions
+             * @param timeout the timeout in seconds
+             * @param handler called on the executor when done
+             * @param driver an identifier of the driver that created the jobs
+             * @param affinity affinity key of each job (see insert_job)
+             */
+            void async_insert_jobs(const std::vector<mongo::BSONObj>& jobs, unsigned int timeout, const completion_handler& handler, const std::string& driver="mdbq::hub",
+                    const std::string& affinity="");
+
+            /**
+             * start a thread which executes database operations.
+             *
+             * Once started, the periodic check of reg() and the async_*
+             * operations run on this thread and do not block the
+             * io_service anymore.
+             *
+             * @param executor io_service which runs the completion handlers
+             */
+            void start_io_thread(boost::asio::io_service& executor);
+
+            /**
+             * finish pending asynchronous operations and stop the I/O thread.
+             */
+            void stop_io_thread();
+
             /**
              * get newest finished job (primarily for testing)
+             *
+             * this also considers archived jobs.
              */
             mongo::BSONObj get_newest_finished();
 
@@ -63,29 +142,221 @@ namespace mdbq
             size_t get_n_assigned();
 
             /**
-             * get number of jobs finished
+             * get number of jobs finished (including archived ones)
              */
             size_t get_n_ok();
 
             /**
-             * get number of jobs failed
+             * get number of jobs failed (including archived ones)
              */
             size_t get_n_failed();
 
+            /**
+             * get number of jobs cancelled
+             */
+            size_t get_n_cancelled();
+
+            /**
+             * cancel jobs.
+             *
+             * Pending jobs are not handed out anymore. Running jobs are
+             * flagged, their clients get a cancelled_exception at their
+             * next checkpoint.
+             *
+             * @param query selects the jobs to cancel, e.g. BSON("exp_key"<<"foo")
+             *        or BSON("misc.bar"<<1). It must not constrain "state".
+             * @return the number of jobs cancelled
+             */
+            size_t cancel_jobs(const mongo::BSONObj& query);
+
+            /**
+             * remove log entries of a level after some time.
+             *
+             * enforced by the hub's periodic check. Files logged with the
+             * entries are removed as well.
+             *
+             * @param level the log level the policy applies to
+             * @param max_age age in seconds, 0 removes the policy
+             */
+            void set_log_retention(int level, unsigned int max_age);
+
+            /**
+             * let the database expire all log entries after some time.
+             *
+             * uses a TTL index on the timestamp, which needs no running
+             * hub but ignores levels and leaves logged files in GridFS
+             * (see set_orphan_cleanup).
+             *
+             * @param max_age age in seconds, 0 drops the index
+             */
+            void set_log_ttl(unsigned int max_age);
+
+            /**
+             * thin out old log entries.
+             *
+             * of entries older than after seconds only every
+             * keep_every-th entry of a task is kept. Entries with files
+             * are not touched.
+             *
+             * @param after age in seconds, 0 disables downsampling
+             * @param keep_every keep one in this many entries
+             */
+            void set_log_downsampling(unsigned int after, unsigned int keep_every);
+
+            /**
+             * remove GridFS files whose task no longer exists.
+             *
+             * the hub's periodic check looks at a batch of files at a
+             * time (see set_archival). Files younger than an hour are
+             * left alone, their job may not be inserted yet.
+             */
+            void set_orphan_cleanup(bool enable=true);
+
+            /**
+             * move large job descriptions out of the jobs collection.
+             *
+             * top-level fields of the job description which are larger
+             * than bytes are stored in GridFS by insert_job, and replaced
+             * by a reference. Clients load them on demand with
+             * Client::fetch_blob or Client::stream_blob; code reading
+             * such fields directly sees the reference instead of the
+             * value. Offloading is disabled by default.
+             *
+             * @param bytes size threshold, e.g. 256 kB, 0 disables offloading
+             */
+            void set_offload_threshold(size_t bytes);
+
+            /**
+             * configure fair-share scheduling of an experiment.
+             *
+             * clients with fair-share scheduling enabled claim jobs of the
+             * experiments (identified by the driver given to insert_job)
+             * in proportion to their weights, and never run more than
+             * max_running jobs of an experiment at once. Experiments which
+             * were not configured have weight 1 and no cap.
+             *
+             * @param exp_key the experiment
+             * @param weight the relative share of the experiment
+             * @param max_running maximum number of running jobs, 0 is unlimited
+             */
+            void set_experiment_share(const std::string& exp_key, double weight, unsigned int max_running=0);
+
+            /**
+             * get queue metrics.
+             *
+             * The returned document contains the number of jobs per state
+             * (states), per experiment the number of jobs per state, the
+             * configured weight and the share of running jobs
+             * (experiments), the age
+             * in seconds of the oldest pending job (oldest_pending_age),
+             * run time percentiles in seconds of recently finished jobs
+             * (runtime), the fraction of failed among finished jobs
+             * (failure_rate), the number of rescheduled jobs (rescheduled)
+             * and the number of running jobs per owner (workers).
+             */
+            mongo::BSONObj get_metrics();
+
+            /**
+             * periodically export queue metrics from the check registered with reg().
+             *
+             * the file is replaced atomically.
+             *
+             * @param path file to write, empty disables exporting
+             * @param format file format
+             * @param every export on every n-th check only
+             * @param runtime_window number of recently finished jobs for run time percentiles
+             */
+            void set_metrics_export(const std::string& path, MetricsFormat format=MF_PROMETHEUS, unsigned int every=1, unsigned int runtime_window=1000);
+
             /**
              * clear the whole job queue
              */
             void clear_all();
 
+            /**
+             * move old finished jobs to the archive collection.
+             *
+             * Jobs in state TS_OK and permanently failed jobs (failed
+             * after rescheduling) which finished more than max_age seconds
+             * ago are moved from <prefix>.jobs to <prefix>.jobs_archive
+             * by the hub's periodic check, at most batch_size per check.
+             * Moving is idempotent, an interrupted batch is completed by
+             * the next check.
+             *
+             * @param max_age minimum age in seconds, 0 disables archival
+             * @param batch_size maximum number of jobs moved per check
+             */
+            void set_archival(unsigned int max_age, unsigned int batch_size=1000);
+
+            /**
+             * generate jobs lazily from a sweep.
+             *
+             * jobs are only produced when the queue runs low (see
+             * set_watermarks). Progress is stored under name, so that a
+             * restarted hub adding the same generator continues the
+             * sweep instead of starting over. With several hubs (see
+             * reg), only the oldest one produces jobs, so all of them
+             * should add the same generators; a hub taking over
+             * continues from the stored progress.
+             *
+             * @param name unique name of the sweep
+             * @param gen the generator, e.g. GridGenerator or RandomSweepGenerator
+             * @param timeout timeout of the produced jobs in seconds
+             * @param driver exp_key of the produced jobs
+             */
+            void add_generator(const std::string& name, const boost::shared_ptr<JobGenerator>& gen,
+                    unsigned int timeout, const std::string& driver="mdbq::hub");
+
+            /**
+             * generate jobs lazily from a sweep, with resource requirements.
+             *
+             * @param resources resource requirements of the produced jobs
+             * @param affinity affinity key of the produced jobs (see insert_job)
+             */
+            void add_generator(const std::string& name, const boost::shared_ptr<JobGenerator>& gen,
+                    unsigned int timeout, const std::string& driver, const mongo::BSONObj& resources,
+                    const std::string& affinity="");
+
+            /**
+             * bound the number of pending jobs.
+             *
+             * when the number of new jobs falls below low at the hub's
+             * periodic check, produce() is asked to refill up to high.
+             *
+             * @param low refill below this many pending jobs
+             * @param high refill up to this many pending jobs, 0 disables refilling
+             */
+            void set_watermarks(unsigned int low, unsigned int high);
+
+            /**
+             * produce n new jobs, called when the queue runs low.
+             *
+             * the default takes them from the generators added with
+             * add_generator. Override this to create jobs yourself, using
+             * insert_jobs().
+             */
+            virtual void produce(unsigned int n);
+
             /**
              * register with the main loop
              *
+             * Several hubs may be registered on the same prefix. They hold
+             * leases in the hubs collection and split the jobs among
+             * themselves for rescheduling and archival; the oldest hub
+             * also reconciles experiments and exports metrics. Partitions
+             * of a hub which stops are taken over within three intervals.
+             *
              * @param interval querying interval
              */
             void reg(boost::asio::io_service& io_service, unsigned int interval);
 
             virtual void got_new_results();
 
+            /**
+             * dtor.
+             */
+            virtual ~Hub();
+
     };
 }
 #endif /* __MDBQ_HUB_HPP__ */
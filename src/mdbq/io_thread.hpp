@@ -0,0 +1,88 @@
+#ifndef __MDBQ_IO_THREAD_HPP__
+#     define __MDBQ_IO_THREAD_HPP__
+
+#include <new>
+#include <stdexcept>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/exception_ptr.hpp>
+#include <mongo/client/dbclient.h>
+
+namespace mdbq
+{
+    /**
+     * a thread running a private io_service.
+     *
+     * Hub and Client post their database operations here, so that blocking
+     * mongo calls do not stall the io_service of the caller.
+     */
+    struct IoThread{
+        boost::asio::io_service                         m_io;
+        boost::scoped_ptr<boost::asio::io_service::work> m_work;
+        boost::scoped_ptr<boost::thread>                 m_thread;
+
+        ~IoThread(){ stop(); }
+
+        bool running()const{ return m_thread.get() != NULL; }
+
+        void start(){
+            if(running())
+                return;
+            m_io.reset();
+            m_work.reset(new boost::asio::io_service::work(m_io));
+            m_thread.reset(new boost::thread(boost::bind(&IoThread::run, this)));
+        }
+
+        /// finishes all pending operations, then joins the thread
+        void stop(){
+            if(!running())
+                return;
+            m_work.reset();
+            m_thread->join();
+            m_thread.reset();
+        }
+
+        template<class F>
+        void post(F f){
+            if(!running())
+                throw std::runtime_error("MDBQ: asynchronous operation requested, but no I/O thread started");
+            m_io.post(f);
+        }
+
+        private:
+        void run(){ m_io.run(); }
+    };
+
+    /**
+     * capture the exception currently being handled for delivery to another thread.
+     *
+     * database errors are rethrown as mongo::SocketException or
+     * mongo::DBException, standard errors as their standard base class.
+     * Other exceptions become a std::runtime_error with the same message.
+     * Must be called from within a catch block.
+     */
+    inline boost::exception_ptr capture_exception(){
+        try{
+            throw;
+        }catch(boost::exception&){
+            return boost::current_exception();
+        }catch(mongo::SocketException& e){
+            return boost::copy_exception(e);
+        }catch(mongo::DBException& e){
+            return boost::copy_exception(e);
+        }catch(std::bad_alloc& e){
+            return boost::copy_exception(e);
+        }catch(std::logic_error& e){
+            return boost::copy_exception(e);
+        }catch(std::runtime_error& e){
+            return boost::copy_exception(e);
+        }catch(std::exception& e){
+            return boost::copy_exception(std::runtime_error(e.what()));
+        }catch(...){
+            return boost::copy_exception(std::runtime_error("MDBQ: unknown exception"));
+        }
+    }
+}
+#endif /* __MDBQ_IO_THREAD_HPP__ */
@@ -0,0 +1,266 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <mongo/client/dbclient.h>
+#include "common.hpp"
+#include "date_time.hpp"
+#include "metrics.hpp"
+
+namespace mdbq
+{
+    namespace
+    {
+        const char* state_name(int state){
+            switch(state){
+                case TS_NEW:       return "new";
+                case TS_RUNNING:   return "running";
+                case TS_OK:        return "ok";
+                case TS_FAILED:    return "failed";
+                case TS_CANCELLED: return "cancelled";
+            }
+            return "unknown";
+        }
+
+        /// run an aggregation pipeline on the jobs collection, return the result array
+        std::vector<mongo::BSONElement> aggregate(mongo::DBClientConnection& con, const std::string& prefix,
+                const mongo::BSONArray& pipeline, mongo::BSONObj& res){
+            if(!con.runCommand(prefix, BSON("aggregate" << "jobs" << "pipeline" << pipeline), res))
+                throw std::runtime_error("MDBQ: metrics aggregation failed: " + res.toString());
+            return res["result"].Array();
+        }
+
+        /// nearest-rank percentile of a sorted vector
+        double percentile(const std::vector<double>& sorted, double p){
+            if(sorted.empty())
+                return 0.;
+            size_t idx = (size_t)(p * sorted.size());
+            return sorted[std::min(idx, sorted.size()-1)];
+        }
+
+        std::string escape_label(const std::string& s){
+            std::string r;
+            for(unsigned int i = 0; i < s.size(); i++){
+                switch(s[i]){
+                    case '\\': r += "\\\\"; break;
+                    case '"':  r += "\\\""; break;
+                    case '\n': r += "\\n";  break;
+                    default:   r += s[i];
+                }
+            }
+            return r;
+        }
+    }
+
+    mongo::BSONObj collect_metrics(mongo::DBClientConnection& con, const std::string& prefix, unsigned int runtime_window){
+        const std::string jobs = prefix + ".jobs";
+        boost::posix_time::ptime now = universal_date_time();
+        mongo::BSONObjBuilder bob;
+        bob.append("queue", prefix);
+        bob.appendDate("time", to_mongo_date(now));
+
+        // depth per state and per state and experiment. The $match on
+        // state and the projection without _id let the server cover the
+        // $group with the {state, exp_key} index instead of fetching jobs.
+        {
+            mongo::BSONObj res;
+            std::vector<mongo::BSONElement> groups = aggregate(con, prefix, BSON_ARRAY(
+                        BSON("$match" << BSON("state" << BSON("$gte" << TS_NEW << "$lte" << TS_CANCELLED))) <<
+                        BSON("$project" << BSON("_id" << 0 << "state" << 1 << "exp_key" << 1)) <<
+                        BSON("$group" << BSON(
+                                "_id" << BSON("state" << "$state" << "exp_key" << "$exp_key") <<
+                                "n"   << BSON("$sum" << 1)))), res);
+            long long n_state[TS_CANCELLED+1] = {0};
+            std::map<std::string, std::map<int, long long> > exps;
+            for(unsigned int i = 0; i < groups.size(); i++){
+                mongo::BSONObj g = groups[i].Obj();
+                int state = g["_id"]["state"].numberInt();
+                long long n = g["n"].numberLong();
+                if(state >= 0 && state <= TS_CANCELLED)
+                    n_state[state] += n;
+                exps[g["_id"]["exp_key"].str()][state] += n;
+            }
+            mongo::BSONObjBuilder sb;
+            for(int s = TS_NEW; s <= TS_CANCELLED; s++)
+                sb.append(state_name(s), n_state[s]);
+            bob.append("states", sb.obj());
+
+            // fair-share configuration, the experiments collection is small
+            std::map<std::string, mongo::BSONObj> config;
+            std::auto_ptr<mongo::DBClientCursor> p = con.query(prefix + ".experiments", mongo::BSONObj());
+            while(p->more()){
+                mongo::BSONObj f = p->next().getOwned();
+                config[f["_id"].str()] = f;
+            }
+
+            mongo::BSONArrayBuilder ab;
+            std::map<std::string, std::map<int, long long> >::const_iterator it;
+            for(it = exps.begin(); it != exps.end(); ++it){
+                mongo::BSONObjBuilder xb;
+                xb.append("exp_key", it->first);
+                mongo::BSONObjBuilder stb;
+                long long running = 0;
+                for(std::map<int, long long>::const_iterator st = it->second.begin(); st != it->second.end(); ++st){
+                    stb.append(state_name(st->first), st->second);
+                    if(st->first == TS_RUNNING)
+                        running = st->second;
+                }
+                xb.append("states", stb.obj());
+                const mongo::BSONObj& c = config[it->first];
+                xb.append("weight", c["weight"].isNumber() ? c["weight"].Number() : 1.);
+                xb.append("cap", c["cap"].numberInt());
+                xb.append("share", n_state[TS_RUNNING] ? running / (double)n_state[TS_RUNNING] : 0.);
+                ab.append(xb.obj());
+            }
+            bob.append("experiments", ab.arr());
+
+            long long done = n_state[TS_OK] + n_state[TS_FAILED];
+            bob.append("failure_rate", done ? n_state[TS_FAILED] / (double)done : 0.);
+        }
+
+        // age of the oldest pending job
+        {
+            mongo::BSONObj fields = BSON("create_time" << 1);
+            mongo::BSONObj f = con.findOne(jobs,
+                    QUERY("state" << TS_NEW).sort("create_time"), &fields);
+            double age = 0.;
+            if(!f.isEmpty() && f["create_time"].type() == mongo::Date)
+                age = (now - to_ptime(f["create_time"].Date())).total_milliseconds() / 1000.;
+            bob.append("oldest_pending_age", age);
+        }
+
+        // run-time percentiles of the most recently finished jobs
+        {
+            mongo::BSONObj res;
+            std::vector<mongo::BSONElement> runs = aggregate(con, prefix, BSON_ARRAY(
+                        BSON("$match" << BSON("state" << TS_OK)) <<
+                        BSON("$sort"  << BSON("finish_time" << -1)) <<
+                        BSON("$limit" << (int)runtime_window) <<
+                        BSON("$project" << BSON(
+                                "_id" << 0 <<
+                                "d"   << BSON("$subtract" << BSON_ARRAY("$finish_time" << "$book_time"))))), res);
+            std::vector<double> d;
+            d.reserve(runs.size());
+            for(unsigned int i = 0; i < runs.size(); i++){
+                mongo::BSONElement e = runs[i].Obj()["d"];
+                if(e.isNumber())
+                    d.push_back(e.Number() / 1000.);
+            }
+            std::sort(d.begin(), d.end());
+            bob.append("runtime", BSON(
+                        "n"   << (int)d.size() <<
+                        "p50" << percentile(d, .5) <<
+                        "p90" << percentile(d, .9) <<
+                        "p99" << percentile(d, .99) <<
+                        "max" << (d.empty() ? 0. : d.back())));
+        }
+
+        // jobs which had to be rescheduled at least once, on the nfailed index
+        bob.append("rescheduled", (long long)con.count(jobs, BSON("nfailed" << mongo::GT << 0)));
+
+        // running jobs per worker
+        {
+            mongo::BSONObj res;
+            std::vector<mongo::BSONElement> owners = aggregate(con, prefix, BSON_ARRAY(
+                        BSON("$match" << BSON("state" << TS_RUNNING)) <<
+                        BSON("$group" << BSON(
+                                "_id" << "$owner" <<
+                                "n"   << BSON("$sum" << 1)))), res);
+            mongo::BSONArrayBuilder ab;
+            for(unsigned int i = 0; i < owners.size(); i++){
+                mongo::BSONObj g = owners[i].Obj();
+                ab.append(BSON("owner" << g["_id"].str() << "running" << g["n"].numberLong()));
+            }
+            bob.append("n_workers", (int)owners.size());
+            bob.append("workers", ab.arr());
+        }
+        return bob.obj();
+    }
+
+    std::string metrics_to_prometheus(const mongo::BSONObj& m){
+        std::ostringstream os;
+        std::string q = "queue=\"" + escape_label(m["queue"].str()) + "\"";
+
+        os << "# HELP mdbq_jobs Number of jobs in the queue by state.\n"
+           << "# TYPE mdbq_jobs gauge\n";
+        mongo::BSONObjIterator sit(m["states"].Obj());
+        while(sit.more()){
+            mongo::BSONElement e = sit.next();
+            os << "mdbq_jobs{" << q << ",state=\"" << e.fieldName() << "\"} " << e.numberLong() << "\n";
+        }
+
+        os << "# HELP mdbq_experiment_jobs Number of jobs in the queue by experiment and state.\n"
+           << "# TYPE mdbq_experiment_jobs gauge\n";
+        std::vector<mongo::BSONElement> exps = m["experiments"].Array();
+        for(unsigned int i = 0; i < exps.size(); i++){
+            mongo::BSONObj x = exps[i].Obj();
+            std::string k = escape_label(x["exp_key"].str());
+            mongo::BSONObjIterator it(x["states"].Obj());
+            while(it.more()){
+                mongo::BSONElement e = it.next();
+                os << "mdbq_experiment_jobs{" << q << ",exp_key=\"" << k << "\",state=\"" << e.fieldName() << "\"} " << e.numberLong() << "\n";
+            }
+        }
+
+        os << "# HELP mdbq_experiment_share Fraction of running jobs by experiment.\n"
+           << "# TYPE mdbq_experiment_share gauge\n";
+        for(unsigned int i = 0; i < exps.size(); i++){
+            mongo::BSONObj x = exps[i].Obj();
+            os << "mdbq_experiment_share{" << q << ",exp_key=\"" << escape_label(x["exp_key"].str()) << "\"} " << x["share"].Number() << "\n";
+        }
+
+        os << "# HELP mdbq_experiment_weight Configured fair-share weight by experiment.\n"
+           << "# TYPE mdbq_experiment_weight gauge\n";
+        for(unsigned int i = 0; i < exps.size(); i++){
+            mongo::BSONObj x = exps[i].Obj();
+            os << "mdbq_experiment_weight{" << q << ",exp_key=\"" << escape_label(x["exp_key"].str()) << "\"} " << x["weight"].Number() << "\n";
+        }
+
+        os << "# HELP mdbq_oldest_pending_seconds Age of the oldest pending job.\n"
+           << "# TYPE mdbq_oldest_pending_seconds gauge\n"
+           << "mdbq_oldest_pending_seconds{" << q << "} " << m["oldest_pending_age"].Number() << "\n";
+
+        mongo::BSONObj rt = m["runtime"].Obj();
+        os << "# HELP mdbq_runtime_seconds Run time of recently finished jobs.\n"
+           << "# TYPE mdbq_runtime_seconds summary\n"
+           << "mdbq_runtime_seconds{" << q << ",quantile=\"0.5\"} "  << rt["p50"].Number() << "\n"
+           << "mdbq_runtime_seconds{" << q << ",quantile=\"0.9\"} "  << rt["p90"].Number() << "\n"
+           << "mdbq_runtime_seconds{" << q << ",quantile=\"0.99\"} " << rt["p99"].Number() << "\n"
+           << "mdbq_runtime_seconds_count{" << q << "} " << rt["n"].numberInt() << "\n";
+
+        os << "# HELP mdbq_failure_ratio Fraction of failed among finished jobs.\n"
+           << "# TYPE mdbq_failure_ratio gauge\n"
+           << "mdbq_failure_ratio{" << q << "} " << m["failure_rate"].Number() << "\n";
+
+        os << "# HELP mdbq_rescheduled_jobs Number of jobs which failed at least once.\n"
+           << "# TYPE mdbq_rescheduled_jobs gauge\n"
+           << "mdbq_rescheduled_jobs{" << q << "} " << m["rescheduled"].numberLong() << "\n";
+
+        os << "# HELP mdbq_workers Number of workers with running jobs.\n"
+           << "# TYPE mdbq_workers gauge\n"
+           << "mdbq_workers{" << q << "} " << m["n_workers"].numberInt() << "\n";
+
+        os << "# HELP mdbq_worker_jobs Number of running jobs by worker.\n"
+           << "# TYPE mdbq_worker_jobs gauge\n";
+        std::vector<mongo::BSONElement> workers = m["workers"].Array();
+        for(unsigned int i = 0; i < workers.size(); i++){
+            mongo::BSONObj w = workers[i].Obj();
+            os << "mdbq_worker_jobs{" << q << ",owner=\"" << escape_label(w["owner"].str()) << "\"} " << w["running"].numberLong() << "\n";
+        }
+        return os.str();
+    }
+
+    void write_file_atomically(const std::string& path, const std::string& content){
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream os(tmp.c_str());
+            os << content;
+            if(!os)
+                throw std::runtime_error("MDBQ: could not write `" + tmp + "'");
+        }
+        if(std::rename(tmp.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("MDBQ: could not rename `" + tmp + "' to `" + path + "'");
+    }
+}
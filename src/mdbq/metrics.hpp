@@ -0,0 +1,31 @@
+#ifndef __MDBQ_METRICS_HPP__
+#     define __MDBQ_METRICS_HPP__
+#include <string>
+#include <mongo/client/dbclient.h>
+
+namespace mdbq
+{
+    /**
+     * collect queue metrics of the jobs collection (see Hub::get_metrics).
+     *
+     * only aggregations, counts and single-document lookups backed by
+     * the indexes the Hub creates are used, no job document is
+     * transferred as a whole.
+     *
+     * @param con the connection to use
+     * @param prefix database plus queue prefix
+     * @param runtime_window number of recently finished jobs to compute run-time percentiles on
+     */
+    mongo::BSONObj collect_metrics(mongo::DBClientConnection& con, const std::string& prefix, unsigned int runtime_window);
+
+    /**
+     * format metrics in the Prometheus text exposition format.
+     */
+    std::string metrics_to_prometheus(const mongo::BSONObj& metrics);
+
+    /**
+     * replace file contents such that readers never see a partial file.
+     */
+    void write_file_atomically(const std::string& path, const std::string& content);
+}
+#endif /* __MDBQ_METRICS_HPP__ */
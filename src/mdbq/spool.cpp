@@ -0,0 +1,99 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include "spool.hpp"
+
+namespace mdbq
+{
+    namespace
+    {
+        const char   MAGIC[8]    = {'m','d','b','q','s','p','l','1'};
+        const size_t DATA_OFFSET = 64; ///< records start here, the header fits in front
+
+        /// make sure the file exists and has at least size bytes
+        void ensure_file(const std::string& path, size_t size){
+            size_t cur = 0;
+            {
+                std::ifstream is(path.c_str(), std::ios::binary | std::ios::ate);
+                if(is)
+                    cur = is.tellg();
+            }
+            if(cur >= size)
+                return;
+            std::filebuf fb;
+            if(!fb.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary)
+                    && !fb.open(path.c_str(), std::ios::out | std::ios::binary))
+                throw std::runtime_error("MDBQ: cannot create spool file `" + path + "'");
+            fb.pubseekoff(size - 1, std::ios::beg);
+            fb.sputc(0);
+        }
+
+        const char* prepare_file(const std::string& path, size_t size){
+            ensure_file(path, size);
+            return path.c_str();
+        }
+    }
+
+    Spool::Spool(const std::string& path, size_t capacity)
+        : m_file(prepare_file(path, DATA_OFFSET + capacity), boost::interprocess::read_write)
+        , m_region(m_file, boost::interprocess::read_write)
+        , m_capacity(m_region.get_size() - DATA_OFFSET)
+    {
+        Header* h = header();
+        if(std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0){
+            // a new file
+            h->head = h->tail = 0;
+            std::memcpy(h->magic, MAGIC, sizeof(MAGIC));
+            sync_header();
+        }
+        if(h->head > h->tail || h->tail > m_capacity)
+            throw std::runtime_error("MDBQ: spool file `" + path + "' is corrupt");
+    }
+
+    Spool::Header* Spool::header()const{
+        return static_cast<Header*>(m_region.get_address());
+    }
+    char* Spool::data()const{
+        return static_cast<char*>(m_region.get_address()) + DATA_OFFSET;
+    }
+    void Spool::sync_header(){
+        m_region.flush(0, sizeof(Header));
+    }
+
+    bool Spool::append(const mongo::BSONObj& rec){
+        Header* h = header();
+        size_t n = rec.objsize();
+        if(h->tail + n > m_capacity)
+            return false;
+        std::memcpy(data() + h->tail, rec.objdata(), n);
+        m_region.flush(DATA_OFFSET + h->tail, n);
+        h->tail += n;
+        sync_header();
+        return true;
+    }
+
+    bool Spool::empty()const{
+        return header()->head == header()->tail;
+    }
+
+    size_t Spool::used()const{
+        return header()->tail - header()->head;
+    }
+
+    mongo::BSONObj Spool::front()const{
+        if(empty())
+            throw std::runtime_error("MDBQ: spool is empty");
+        mongo::BSONObj rec(data() + header()->head);
+        if((size_t)rec.objsize() > used())
+            throw std::runtime_error("MDBQ: spool record is corrupt");
+        return rec.getOwned();
+    }
+
+    void Spool::pop(){
+        Header* h = header();
+        h->head += mongo::BSONObj(data() + h->head).objsize();
+        if(h->head == h->tail)
+            h->head = h->tail = 0; // rewind
+        sync_header();
+    }
+}
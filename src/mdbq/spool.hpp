@@ -0,0 +1,68 @@
+#ifndef __MDBQ_SPOOL_HPP__
+#     define __MDBQ_SPOOL_HPP__
+#include <string>
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <mongo/client/dbclient.h>
+
+namespace mdbq
+{
+    /**
+     * an append-only queue of BSON records in a memory-mapped file.
+     *
+     * a record is written completely before the tail pointer is moved
+     * past it, so records survive a crash of the process and a torn
+     * record is never read. Records are consumed in order from the head.
+     * The file is only rewound when it is empty, so it is not a ring
+     * buffer: once the tail reaches the end, append() fails until all
+     * records have been consumed.
+     */
+    class Spool{
+        public:
+            /**
+             * open or create a spool file.
+             *
+             * @param path file name
+             * @param capacity bytes available for records, an existing file is grown if smaller
+             */
+            Spool(const std::string& path, size_t capacity);
+
+            /**
+             * append a record.
+             *
+             * @return false if there is not enough room left
+             */
+            bool append(const mongo::BSONObj& rec);
+
+            /// true if there are no records
+            bool empty()const;
+
+            /// the oldest record, owned
+            mongo::BSONObj front()const;
+
+            /// consume the oldest record
+            void pop();
+
+            /// bytes available for records
+            size_t capacity()const{ return m_capacity; }
+
+            /// bytes used by records not consumed yet
+            size_t used()const;
+
+        private:
+            struct Header{
+                char            magic[8];
+                boost::uint64_t head;
+                boost::uint64_t tail;
+            };
+            Header* header()const;
+            char*   data()const;
+            void    sync_header();
+
+            boost::interprocess::file_mapping  m_file;
+            boost::interprocess::mapped_region m_region;
+            size_t m_capacity;
+    };
+}
+#endif /* __MDBQ_SPOOL_HPP__ */
@@ -1,12 +1,19 @@
+#include <cstdio>
 #include <stdexcept>
+#include <fstream>
+#include <sstream>
 #include <mongo/client/dbclient.h>
 
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <mdbq/hub.hpp>
 #include <mdbq/client.hpp>
+#include <mdbq/spool.hpp>
+#include <mdbq/generator.hpp>
+#include <mdbq/io_thread.hpp>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE MdbQ
@@ -198,6 +205,589 @@ BOOST_AUTO_TEST_CASE(hardcore){
     BOOST_CHECK_EQUAL(n_jobs, hub.get_n_ok());
 }
 
+void set_flag(bool* flag, boost::exception_ptr err){
+    BOOST_CHECK(!err);
+    *flag = true;
+}
+
+BOOST_AUTO_TEST_CASE(async_loop){
+    std::vector<mongo::BSONObj> jobs;
+    for (int i = 0; i < 10; ++i)
+        jobs.push_back(BSON("foo"<<i<<"bar"<<i));
+
+    boost::asio::io_service io, compute;
+    boost::scoped_ptr<boost::asio::io_service::work> compute_work(new boost::asio::io_service::work(compute));
+    boost::thread compute_thread(boost::bind(&boost::asio::io_service::run, &compute));
+
+    bool inserted = false;
+    hub.start_io_thread(io);
+    hub.async_insert_jobs(jobs, 1000, boost::bind(set_flag, &inserted, _1));
+
+    // handle_task runs on the compute thread, not on io
+    work_a_bit_client wabc(HOST,"test_mdbq");
+    wabc.start_io_thread(compute);
+    wabc.reg(io, 0.1);
+    hub.reg(io, 1);
+
+    boost::asio::deadline_timer dt(io, boost::posix_time::seconds(5));
+    dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+    io.run();
+
+    wabc.stop_io_thread();
+    hub.stop_io_thread();
+    compute_work.reset();
+    compute_thread.join();
+
+    BOOST_CHECK(inserted);
+    BOOST_CHECK_EQUAL(10, hub.get_n_ok());
+}
+
+BOOST_AUTO_TEST_CASE(async_error_types){
+    // completion handlers can tell errors apart by type
+    boost::exception_ptr err;
+    try{
+        throw std::out_of_range("index");
+    }catch(...){
+        err = capture_exception();
+    }
+    BOOST_CHECK_THROW(boost::rethrow_exception(err), std::logic_error);
+    try{
+        throw timeout_exception();
+    }catch(...){
+        err = capture_exception();
+    }
+    BOOST_CHECK_THROW(boost::rethrow_exception(err), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(cancellation){
+    hub.insert_job(BSON("foo"<<1<<"bar"<<1), 1000);
+    hub.insert_job(BSON("foo"<<1<<"bar"<<2), 1000);
+    hub.insert_job(BSON("foo"<<2<<"bar"<<3), 1000);
+
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.checkpoint();
+    BOOST_CHECK_EQUAL(2, hub.cancel_jobs(BSON("misc.foo"<<1)));
+    BOOST_CHECK_EQUAL(1, hub.get_n_cancelled());
+    BOOST_CHECK_THROW(clt.checkpoint(), cancelled_exception);
+    BOOST_CHECK_EQUAL(2, hub.get_n_cancelled());
+
+    // only the job which was not cancelled is handed out
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK_EQUAL(2, task["foo"].Int());
+    clt.finish(BSON("baz"<<3));
+    BOOST_CHECK(!clt.get_next_task(task));
+}
+
+BOOST_AUTO_TEST_CASE(metrics){
+    hub.insert_job(BSON("foo"<<1), 1000, "exp_a");
+    hub.insert_job(BSON("foo"<<2), 1000, "exp_a");
+    hub.insert_job(BSON("foo"<<3), 1000, "exp_b");
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.finish(BSON("loss"<<1.0));
+    BOOST_CHECK(clt.get_next_task(task));
+
+    mongo::BSONObj m = hub.get_metrics();
+    BOOST_CHECK_EQUAL(1, m["states"]["new"].numberLong());
+    BOOST_CHECK_EQUAL(1, m["states"]["running"].numberLong());
+    BOOST_CHECK_EQUAL(1, m["states"]["ok"].numberLong());
+    BOOST_CHECK_EQUAL(2, m["experiments"].Array().size());
+    BOOST_CHECK_EQUAL(1, m["runtime"]["n"].Int());
+    BOOST_CHECK_EQUAL(1, m["n_workers"].Int());
+    BOOST_CHECK_EQUAL(0., m["failure_rate"].Number());
+
+    hub.set_metrics_export("mdbq_test_metrics.prom");
+    boost::asio::io_service io;
+    hub.reg(io, 1);
+    boost::asio::deadline_timer dt(io, boost::posix_time::seconds(2));
+    dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+    io.run();
+    std::ifstream is("mdbq_test_metrics.prom");
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    BOOST_CHECK(content.find("mdbq_jobs{queue=\"test_mdbq\",state=\"new\"} 1") != std::string::npos);
+    is.close();
+    std::remove("mdbq_test_metrics.prom");
+    clt.finish(BSON("loss"<<2.0));
+}
+
+void count_error(int* n, const mongo::BSONObj& task, const std::string& /*err*/){
+    BOOST_CHECK(task.hasField("_id"));
+    (*n)++;
+}
+
+BOOST_AUTO_TEST_CASE(group_commit){
+    for (int i = 0; i < 4; ++i)
+        hub.insert_job(BSON("foo"<<i), 1000);
+    int n_errors = 0;
+    clt.set_write_concern(WO_LOG, WC_UNACKNOWLEDGED);
+    clt.set_group_commit(3, boost::bind(count_error, &n_errors, _1, _2));
+
+    mongo::BSONObj task;
+    for (int i = 0; i < 2; ++i){
+        BOOST_CHECK(clt.get_next_task(task));
+        clt.log(0, BSON("i"<<i));
+        clt.finish(BSON("loss"<<i));
+    }
+    BOOST_CHECK_EQUAL(0, hub.get_n_ok());
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.finish(BSON("loss"<<2));
+    BOOST_CHECK_EQUAL(3, hub.get_n_ok());
+
+    // a result whose task was taken over in the meantime is reported
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.finish(BSON("loss"<<3));
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    c.update("test_mdbq.jobs", QUERY("state"<<1), BSON("$inc"<<BSON("version"<<1)));
+    BOOST_CHECK_EQUAL(0, clt.flush_finished());
+    BOOST_CHECK_EQUAL(1, n_errors);
+    BOOST_CHECK_EQUAL(3, hub.get_n_ok());
+
+    // a busy worker does not hold back results longer than max_delay
+    for (int i = 0; i < 2; ++i)
+        hub.insert_job(BSON("bar"<<i), 1000);
+    clt.set_group_commit(3, boost::bind(count_error, &n_errors, _1, _2), 0);
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.finish(BSON("loss"<<4));
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK_EQUAL(4, hub.get_n_ok());
+
+    // without grouping, a result which lost the version guard throws
+    clt.set_group_commit(0);
+    c.update("test_mdbq.jobs", QUERY("state"<<1), BSON("$inc"<<BSON("version"<<1)));
+    BOOST_CHECK_THROW(clt.finish(BSON("loss"<<5)), std::runtime_error);
+    BOOST_CHECK_EQUAL(4, hub.get_n_ok());
+}
+
+BOOST_AUTO_TEST_CASE(fair_share){
+    for (int i = 0; i < 6; ++i)
+        hub.insert_job(BSON("foo"<<i), 1000, "exp_a");
+    for (int i = 0; i < 2; ++i)
+        hub.insert_job(BSON("foo"<<i), 1000, "exp_b");
+    hub.set_experiment_share("exp_b", 1., 1);
+    clt.set_fair_share();
+
+    // exp_a was inserted first, but both experiments get their share
+    mongo::BSONObj task;
+    for (int i = 0; i < 4; ++i){
+        BOOST_CHECK(clt.get_next_task(task));
+        clt.finish(BSON("loss"<<i));
+    }
+    mongo::BSONObj m = hub.get_metrics();
+    std::vector<mongo::BSONElement> exps = m["experiments"].Array();
+    BOOST_CHECK_EQUAL(2, exps.size());
+    for (unsigned int i = 0; i < exps.size(); ++i)
+        BOOST_CHECK_EQUAL(2, exps[i].Obj()["states"]["ok"].numberLong());
+
+    // a new experiment starts level with the others instead of taking every claim
+    for (int i = 0; i < 4; ++i)
+        hub.insert_job(BSON("foo"<<i), 1000, "exp_c");
+    for (int i = 0; i < 3; ++i){
+        BOOST_CHECK(clt.get_next_task(task));
+        clt.finish(BSON("loss"<<i));
+    }
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.jobs", BSON("exp_key"<<"exp_c"<<"finish_time"<<BSON("$exists"<<true))));
+
+    // cancelling keeps the pending counter right
+    BOOST_CHECK_EQUAL(3, hub.cancel_jobs(BSON("exp_key"<<"exp_c")));
+    BOOST_CHECK_EQUAL(0, c.findOne("test_mdbq.experiments", QUERY("_id"<<"exp_c"))["open"].numberInt());
+
+    // jobs are claimed even if their experiment's counter drifted
+    c.update("test_mdbq.experiments", mongo::BSONObj(), BSON("$set"<<BSON("open"<<0)), false, true);
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.finish(BSON("loss"<<1));
+}
+
+BOOST_AUTO_TEST_CASE(resources){
+    hub.insert_job(BSON("size"<<"big"), 1000, "mdbq::hub", BSON("mem"<<16));
+    hub.insert_job(BSON("size"<<"gpu"), 1000, "mdbq::hub", BSON("mem"<<1<<"gpu"<<1));
+    hub.insert_job(BSON("size"<<"small"), 1000, "mdbq::hub", BSON("mem"<<4));
+    hub.insert_job(BSON("size"<<"small"), 1000, "mdbq::hub", BSON("mem"<<4));
+    hub.insert_job(BSON("size"<<"small"), 1000, "mdbq::hub", BSON("mem"<<4));
+
+    boost::shared_ptr<ResourcePool> pool(new ResourcePool(BSON("mem"<<10)));
+    Client clt2(HOST,"test_mdbq");
+    Client clt3(HOST,"test_mdbq");
+    clt.set_resources(pool);
+    clt2.set_resources(pool);
+    clt3.set_resources(pool);
+
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK_EQUAL("small", task["size"].String());
+    BOOST_CHECK(clt2.get_next_task(task));
+    BOOST_CHECK_EQUAL("small", task["size"].String());
+    BOOST_CHECK_EQUAL(2., pool->available()["mem"].Number());
+    BOOST_CHECK(!clt3.get_next_task(task));
+
+    clt.finish(BSON("loss"<<1));
+    BOOST_CHECK_EQUAL(6., pool->available()["mem"].Number());
+    BOOST_CHECK(clt3.get_next_task(task));
+    BOOST_CHECK_EQUAL("small", task["size"].String());
+    BOOST_CHECK(!clt.get_next_task(task)); // neither big nor gpu fit
+}
+
+BOOST_AUTO_TEST_CASE(offload){
+    std::vector<char> data(4096, 'x');
+    mongo::BSONObjBuilder bob;
+    bob.appendBinData("weights", data.size(), mongo::BinDataGeneral, &data[0]);
+    bob.append("lr", 0.1);
+    hub.set_offload_threshold(1024);
+    hub.insert_job(bob.obj(), 1000);
+
+    mongo::BSONObj task;
+    clt.set_task_fields(BSON("weights"<<1));
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK(task["lr"].eoo());
+    BOOST_CHECK_EQUAL(mongo::Object, task["weights"].type());
+    BOOST_CHECK(task["weights"]["mdbq_blob"].String().find("ObjectId") == std::string::npos);
+
+    int len;
+    mongo::BSONObj w = clt.fetch_blob(task, "weights");
+    const char* p = w["weights"].binData(len);
+    BOOST_CHECK_EQUAL(4096, len);
+    BOOST_CHECK_EQUAL(std::string(&data[0], data.size()), std::string(p, len));
+
+    std::ostringstream os;
+    clt.stream_blob(task, "weights", os);
+    BOOST_CHECK_EQUAL(4096u, os.str().size());
+    clt.finish(BSON("loss"<<0));
+    clt.set_task_fields(mongo::BSONObj());
+}
+
+BOOST_AUTO_TEST_CASE(partitioned_hubs){
+    for (int i = 0; i < 20; ++i)
+        hub.insert_job(BSON("foo"<<i), 1000);
+    mongo::BSONObj task;
+    while(clt.get_next_task(task))
+        clt.finish(BSON("loss"<<1), false);
+    BOOST_CHECK_EQUAL(20, hub.get_n_failed());
+
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    {
+        Hub hub2(HOST,"test_mdbq");
+        boost::asio::io_service io;
+        hub.reg(io, 1);
+        hub2.reg(io, 1);
+        boost::asio::deadline_timer dt(io, boost::posix_time::seconds(3));
+        dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+        io.run();
+        BOOST_CHECK_EQUAL(2, c.count("test_mdbq.hubs"));
+    }
+    // each failed job was rescheduled exactly once
+    BOOST_CHECK_EQUAL(20, hub.get_n_open());
+    BOOST_CHECK_EQUAL(20, c.count("test_mdbq.jobs", BSON("nfailed"<<1)));
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.hubs"));
+}
+
+BOOST_AUTO_TEST_CASE(log_retention){
+    hub.insert_job(BSON("foo"<<1), 1000);
+    hub.insert_job(BSON("foo"<<2), 1000);
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    for (int i = 0; i < 10; ++i)
+        clt.log(0, BSON("step"<<i));
+    clt.log(1, BSON("step"<<10));
+    clt.finish(BSON("loss"<<1));
+    BOOST_CHECK(clt.get_next_task(task));
+    const char* s = "hallihallo";
+    clt.log(1, s, strlen(s), BSON("baz"<<3));
+    clt.finish(BSON("loss"<<2));
+
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    c.remove("test_mdbq.jobs", QUERY("result.loss"<<2));
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.fs.files"));
+
+    hub.set_log_retention(0, 1);
+    hub.set_orphan_cleanup();
+    boost::this_thread::sleep(boost::posix_time::seconds(2));
+    boost::asio::io_service io;
+    hub.reg(io, 1);
+    boost::asio::deadline_timer dt(io, boost::posix_time::seconds(2));
+    dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+    io.run();
+    hub.set_log_retention(0, 0);
+    hub.set_orphan_cleanup(false);
+
+    BOOST_CHECK(clt.get_best_task(task));
+    std::vector<mongo::BSONObj> log = clt.get_log(task);
+    BOOST_CHECK_EQUAL(1, log.size());
+    BOOST_CHECK_EQUAL(1, log[0]["level"].Int());
+    BOOST_CHECK_EQUAL(0, c.count("test_mdbq.fs.files"));
+}
+
+BOOST_AUTO_TEST_CASE(metrics_api){
+    hub.insert_job(BSON("foo"<<1), 1000);
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    for (int i = 0; i < 2500; ++i)
+        clt.metric("loss", i, 1. / (i + 1));
+    clt.metric("acc", 0, 0.5);
+    clt.checkpoint();
+    clt.finish(BSON("loss"<<0));
+    BOOST_CHECK(clt.get_best_task(task));
+
+    std::vector<long long> steps;
+    std::vector<double> values;
+    clt.get_metric(task, "loss", steps, values);
+    BOOST_CHECK_EQUAL(2500, steps.size());
+    BOOST_CHECK_EQUAL(1., values[0]);
+    BOOST_CHECK_EQUAL(2499, steps.back());
+
+    clt.get_metric(task, "loss", steps, values, 100, 199);
+    BOOST_CHECK_EQUAL(100, steps.size());
+    BOOST_CHECK_EQUAL(100, steps[0]);
+
+    clt.get_metric(task, "loss", steps, values, LLONG_MIN, LLONG_MAX, 2);
+    BOOST_CHECK_EQUAL(2, steps.size());
+
+    // finer than the buckets, and clipped to the range
+    clt.get_metric(task, "loss", steps, values, LLONG_MIN, LLONG_MAX, 100);
+    BOOST_CHECK_EQUAL(100, steps.size());
+    clt.get_metric(task, "loss", steps, values, 500, 1499, 10);
+    BOOST_CHECK_EQUAL(10, steps.size());
+    BOOST_CHECK_GE(steps.front(), 500);
+    BOOST_CHECK_LE(steps.back(), 1499);
+
+    clt.get_metric(task, "acc", steps, values);
+    BOOST_CHECK_EQUAL(1, values.size());
+}
+
+BOOST_AUTO_TEST_CASE(spool){
+    const char* path = "/tmp/test_mdbq.spool";
+    std::remove(path);
+    {
+        Spool sp(path, 100);
+        BOOST_CHECK(sp.empty());
+        BOOST_CHECK(sp.append(BSON("i"<<1)));
+        BOOST_CHECK(sp.append(BSON("i"<<2)));
+        BOOST_CHECK(!sp.append(BSON("s"<<std::string(100, 'x'))));
+    }
+    {
+        // records survive reopening
+        Spool sp(path, 100);
+        BOOST_CHECK_EQUAL(1, sp.front()["i"].Int());
+        sp.pop();
+        BOOST_CHECK_EQUAL(2, sp.front()["i"].Int());
+        sp.pop();
+        BOOST_CHECK(sp.empty());
+        BOOST_CHECK_EQUAL(0, sp.used());
+    }
+
+    // with a reachable server, writes go through directly
+    hub.insert_job(BSON("foo"<<1), 1000);
+    clt.set_spool(path, 1024*1024);
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.log(0, BSON("step"<<1));
+    clt.checkpoint();
+    clt.finish(BSON("loss"<<1));
+    BOOST_CHECK_EQUAL(1, hub.get_n_ok());
+    BOOST_CHECK(clt.get_best_task(task));
+    BOOST_CHECK_EQUAL(1, clt.get_log(task).size());
+    clt.set_spool("");
+    BOOST_CHECK(Spool(path, 1024*1024).empty());
+}
+
+BOOST_AUTO_TEST_CASE(generators){
+    GridGenerator grid(BSON("a" << BSON_ARRAY(1 << 2) << "b" << BSON_ARRAY("x" << "y" << "z")));
+    BOOST_CHECK_EQUAL(6, grid.size());
+    std::vector<mongo::BSONObj> jobs;
+    BOOST_CHECK(grid.produce(4, jobs));
+    BOOST_CHECK(!grid.produce(4, jobs));
+    BOOST_CHECK_EQUAL(6, jobs.size());
+    BOOST_CHECK_EQUAL(2, jobs[3]["a"].Int());
+    BOOST_CHECK_EQUAL("x", jobs[3]["b"].String());
+
+    jobs.clear();
+    RandomSweepGenerator rnd(BSON("lr" << BSON("min" << 1e-4 << "max" << 1e-1 << "log" << true) << "bs" << 32), 3);
+    BOOST_CHECK(!rnd.produce(10, jobs));
+    BOOST_CHECK_EQUAL(3, jobs.size());
+    BOOST_CHECK(jobs[0]["lr"].Number() >= 1e-4 && jobs[0]["lr"].Number() < 1e-1);
+    BOOST_CHECK_EQUAL(32, jobs[0]["bs"].Int());
+
+    // the queue is kept between the watermarks
+    boost::shared_ptr<JobGenerator> big(new GridGenerator(BSON("i" << BSON_ARRAY(0<<1<<2<<3<<4<<5<<6<<7<<8<<9))));
+    hub.add_generator("sweep", big, 1000);
+    hub.set_watermarks(2, 4);
+    boost::asio::io_service io;
+    hub.reg(io, 1);
+    boost::asio::deadline_timer dt(io, boost::posix_time::seconds(2));
+    dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+    io.run();
+    BOOST_CHECK_EQUAL(4, hub.get_n_open());
+
+    // a second hub continues the sweep
+    Hub hub2(HOST,"test_mdbq");
+    boost::shared_ptr<JobGenerator> again(new GridGenerator(BSON("i" << BSON_ARRAY(0<<1<<2<<3<<4<<5<<6<<7<<8<<9))));
+    hub2.add_generator("sweep", again, 1000);
+    hub2.produce(100);
+    BOOST_CHECK_EQUAL(10, hub.get_n_open());
+
+    // jobs produced again after a crash before the progress was stored are not duplicated
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    c.update("test_mdbq.generators", QUERY("_id"<<"sweep"), BSON("$set"<<BSON("produced"<<4LL<<"done"<<false)));
+    Hub hub3(HOST,"test_mdbq");
+    boost::shared_ptr<JobGenerator> third(new GridGenerator(BSON("i" << BSON_ARRAY(0<<1<<2<<3<<4<<5<<6<<7<<8<<9))));
+    hub3.add_generator("sweep", third, 1000);
+    hub3.produce(100);
+    BOOST_CHECK_EQUAL(10, hub.get_n_open());
+}
+
+BOOST_AUTO_TEST_CASE(generator_ids){
+    // generators added together produce distinct jobs
+    boost::shared_ptr<JobGenerator> a(new GridGenerator(BSON("i" << BSON_ARRAY(0<<1<<2<<3<<4))));
+    boost::shared_ptr<JobGenerator> b(new GridGenerator(BSON("j" << BSON_ARRAY(0<<1<<2))));
+    hub.add_generator("a", a, 1000);
+    hub.add_generator("b", b, 1000);
+    hub.insert_job(BSON("foo"<<1), 1000);
+    hub.produce(100);
+    BOOST_CHECK_EQUAL(9, hub.get_n_open());
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    BOOST_CHECK_EQUAL(5, c.count("test_mdbq.jobs", BSON("generator"<<"a")));
+    BOOST_CHECK_EQUAL(3, c.count("test_mdbq.jobs", BSON("generator"<<"b")));
+    BOOST_CHECK_EQUAL(3, c.findOne("test_mdbq.generators", QUERY("_id"<<"b"))["produced"].numberLong());
+}
+
+BOOST_AUTO_TEST_CASE(speculative){
+    Client straggler(HOST,"test_mdbq");
+    mongo::BSONObj task;
+    hub.insert_job(BSON("slow"<<true), 1000);
+    BOOST_CHECK(straggler.get_next_task(task));
+
+    for (int i = 0; i < 10; ++i)
+        hub.insert_job(BSON("slow"<<false), 1000);
+    while(clt.get_next_task(task))
+        clt.finish(BSON("loss"<<1));
+    BOOST_CHECK_EQUAL(10, hub.get_n_ok());
+
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+    clt.set_speculative(0.5);
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK(task["slow"].Bool());
+    clt.finish(BSON("loss"<<0));
+    BOOST_CHECK_EQUAL(11, hub.get_n_ok());
+    BOOST_CHECK(!clt.get_next_task(task)); // one duplicate per task
+
+    BOOST_CHECK_THROW(straggler.checkpoint(), cancelled_exception);
+    BOOST_CHECK(clt.get_best_task(task));
+    BOOST_CHECK_EQUAL(0, task["result"]["loss"].Number());
+}
+
+BOOST_AUTO_TEST_CASE(speculative_handover){
+    Client straggler(HOST,"test_mdbq");
+    mongo::BSONObj task;
+    hub.insert_job(BSON("slow"<<true), 2);
+    BOOST_CHECK(straggler.get_next_task(task));
+    hub.insert_job(BSON("slow"<<false), 1000);
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.finish(BSON("loss"<<1));
+
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+    clt.set_speculative(0.5, 1);
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK(task["slow"].Bool());
+
+    // the original times out, the duplicate carries on
+    boost::this_thread::sleep(boost::posix_time::millisec(1500));
+    BOOST_CHECK_THROW(straggler.checkpoint(), timeout_exception);
+    clt.checkpoint();
+    clt.finish(BSON("loss"<<0));
+    BOOST_CHECK_EQUAL(2, hub.get_n_ok());
+    BOOST_CHECK_EQUAL(0, hub.get_n_failed());
+}
+
+BOOST_AUTO_TEST_CASE(resume){
+    hub.insert_job(BSON("foo"<<1), 1000);
+    mongo::BSONObj task;
+    std::string state;
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK(!clt.load_state(state));
+    clt.save_state("step=5", 6);
+    clt.checkpoint();
+    clt.finish(BSON("loss"<<1), false);
+
+    boost::asio::io_service io;
+    hub.reg(io, 1);
+    boost::asio::deadline_timer dt(io, boost::posix_time::seconds(2));
+    dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+    io.run();
+
+    // the rescheduled task continues where it left off
+    BOOST_CHECK(clt.get_next_task(task));
+    BOOST_CHECK(clt.load_state(state));
+    BOOST_CHECK_EQUAL("step=5", state);
+
+    // large states go to GridFS, replacing the previous one
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    std::string big(100*1024, 'x');
+    clt.save_state(big.data(), big.size());
+    clt.checkpoint();
+    big[0] = 'y';
+    clt.save_state(big.data(), big.size());
+    clt.checkpoint();
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.fs.files"));
+    clt.finish(BSON("loss"<<0));
+    BOOST_CHECK_EQUAL(0, c.count("test_mdbq.fs.files"));
+
+    // a stale attempt neither overwrites nor removes the state of the next one
+    hub.insert_job(BSON("foo"<<2), 1000);
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.save_state(big.data(), big.size());
+    clt.checkpoint();
+    c.update("test_mdbq.jobs", QUERY("misc.foo"<<2), BSON("$set"<<BSON("owner"<<"someone-else")));
+    clt.save_state("step=1", 6);
+    BOOST_CHECK_THROW(clt.checkpoint(), cancelled_exception);
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.fs.files"));
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.jobs", BSON("saved_state.mdbq_blob"<<BSON("$exists"<<true))));
+}
+
+BOOST_AUTO_TEST_CASE(affinity){
+    Client a(HOST,"test_mdbq"), b(HOST,"test_mdbq");
+    a.set_affinity(2);
+    b.set_affinity(2);
+    mongo::BSONObj task;
+    for (int i = 0; i < 2; ++i){
+        hub.insert_job(BSON("d"<<1), 1000, "mdbq::hub", mongo::BSONObj(), "d1");
+        hub.insert_job(BSON("d"<<2), 1000, "mdbq::hub", mongo::BSONObj(), "d2");
+    }
+    BOOST_CHECK(a.get_next_task(task));
+    BOOST_CHECK_EQUAL(1, task["d"].Int());
+    a.finish(BSON("loss"<<1));
+    BOOST_CHECK(b.get_next_task(task));
+    BOOST_CHECK_EQUAL(2, task["d"].Int()); // d1 is warm on a
+    b.finish(BSON("loss"<<1));
+    BOOST_CHECK(b.get_next_task(task));
+    BOOST_CHECK_EQUAL(2, task["d"].Int());
+    b.finish(BSON("loss"<<1));
+
+    // the last job is left to a for a while
+    BOOST_CHECK(!b.get_next_task(task));
+    boost::this_thread::sleep(boost::posix_time::seconds(3));
+    BOOST_CHECK(b.get_next_task(task));
+    BOOST_CHECK_EQUAL(1, task["d"].Int());
+    b.finish(BSON("loss"<<1));
+
+    // a busy client keeps its keys while it checkpoints
+    hub.insert_job(BSON("d"<<2), 1000, "mdbq::hub", mongo::BSONObj(), "d2");
+    BOOST_CHECK(b.get_next_task(task));
+    for (int i = 0; i < 3; ++i){
+        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        b.checkpoint();
+    }
+    hub.insert_job(BSON("d"<<2), 1000, "mdbq::hub", mongo::BSONObj(), "d2");
+    BOOST_CHECK(!a.get_next_task(task));
+    b.finish(BSON("loss"<<1));
+}
+
 BOOST_AUTO_TEST_CASE(filestorage){
     hub.insert_job(BSON("foo"<<1<<"bar"<<2), 1);
     mongo::BSONObj task;
@@ -206,4 +796,31 @@ BOOST_AUTO_TEST_CASE(filestorage){
     clt.log(0, s, strlen(s), BSON("baz"<<3));
     clt.finish(BSON("baz"<<4));
 }
+
+BOOST_AUTO_TEST_CASE(archival){
+    hub.insert_job(BSON("foo"<<1<<"bar"<<2), 1000);
+    mongo::BSONObj task;
+    BOOST_CHECK(clt.get_next_task(task));
+    clt.log(0, BSON("foo"<<1));
+    clt.finish(BSON("loss"<<0.5));
+
+    hub.set_archival(1);
+    boost::asio::io_service io;
+    hub.reg(io, 1);
+    boost::asio::deadline_timer dt(io, boost::posix_time::seconds(4));
+    dt.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+    io.run();
+
+    mongo::DBClientConnection c;
+    c.connect(HOST);
+    BOOST_CHECK_EQUAL(0, c.count("test_mdbq.jobs"));
+    BOOST_CHECK_EQUAL(1, c.count("test_mdbq.jobs_archive"));
+
+    // archived jobs are still visible through the usual API
+    BOOST_CHECK_EQUAL(1, hub.get_n_ok());
+    mongo::BSONObj best;
+    BOOST_CHECK(clt.get_best_task(best));
+    BOOST_CHECK_EQUAL(0.5, best["result"]["loss"].Number());
+    BOOST_CHECK_EQUAL(1, clt.get_log(best).size());
+}
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,409 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <queue>
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/program_options.hpp>
+#include <mongo/client/dbclient.h>
+
+#include <mdbq/hub.hpp>
+#include <mdbq/client.hpp>
+
+/**
+ * Trace recording and replay for queue capacity planning.
+ *
+ * @code
+ * # record arrivals and service times of a real queue
+ * $ mdbq_trace extract --host db --prefix hyperopt --trace h.csv
+ * # what if we had twice the workers and polled every 5 seconds?
+ * $ mdbq_trace simulate --trace h.csv --workers 16 --poll 5
+ * # the same against a scratch queue, 60 times faster than real time
+ * $ mdbq_trace replay --host localhost --prefix scratch --trace h.csv --workers 16 --poll 5 --speedup 60
+ * @endcode
+ *
+ * A trace is a CSV file with one job per line, in order of arrival:
+ * arrival and service time in seconds, timeout, nfailed and exp_key.
+ * The simulation lets a job which was rescheduled nfailed times first
+ * fail that often, each time holding a worker until its timeout. replay
+ * runs every job once.
+ */
+
+namespace po = boost::program_options;
+
+struct TraceJob{
+    double arrival;  ///< seconds since the first job was created
+    double service;  ///< seconds from claim to finish
+    int timeout;
+    int nfailed;
+    std::string exp_key;
+    bool operator<(const TraceJob& o)const{ return arrival < o.arrival; }
+};
+
+/// a job as it went through a (real or simulated) queue
+struct Done{
+    double arrival, start, end; ///< start and end of the last attempt
+    double busy;                ///< worker time of all attempts
+};
+
+static double seconds(const mongo::BSONElement& e){
+    return (double)(unsigned long long)e.Date() / 1000.;
+}
+
+/**
+ * read the trace of all started jobs in the queue.
+ *
+ * @param observed if given, receives what happened to each job in the queue
+ */
+static std::vector<TraceJob>
+extract(mongo::DBClientConnection& con, const std::string& prefix, std::vector<Done>* observed = NULL){
+    std::vector<TraceJob> trace;
+    std::vector<Done> done;
+    const char* cols[] = {".jobs", ".jobs_archive"};
+    for (unsigned int c = 0; c < 2; ++c)
+    {
+        std::auto_ptr<mongo::DBClientCursor> p = con.query(prefix + cols[c],
+                QUERY("book_time" << BSON("$type" << mongo::Date)),
+                0, 0, NULL);
+        while(p->more()){
+            mongo::BSONObj f = p->next();
+            mongo::BSONElement end = f["finish_time"];
+            if(end.type() != mongo::Date)
+                end = f["failure_time"];
+            if(end.type() != mongo::Date)
+                continue; // still running
+            TraceJob j;
+            j.arrival = seconds(f["create_time"]);
+            j.service = seconds(end) - seconds(f["book_time"]);
+            j.timeout = f["timeout"].numberInt();
+            j.nfailed = f["nfailed"].numberInt();
+            j.exp_key = f["exp_key"].str();
+            trace.push_back(j);
+            Done d;
+            d.arrival = j.arrival;
+            d.start   = seconds(f["book_time"]);
+            d.end     = seconds(end);
+            d.busy    = d.end - d.start;
+            done.push_back(d);
+        }
+    }
+    std::sort(trace.begin(), trace.end());
+    double first = trace.empty() ? 0 : trace[0].arrival;
+    for (unsigned int i = 0; i < trace.size(); ++i)
+    {
+        trace[i].arrival -= first;
+        done[i].arrival  -= first; // same length, not the same order
+        done[i].start    -= first;
+        done[i].end      -= first;
+    }
+    if(observed)
+        observed->swap(done);
+    return trace;
+}
+
+static void
+write_trace(std::ostream& os, const std::vector<TraceJob>& trace){
+    os << "arrival,service,timeout,nfailed,exp_key" << std::endl;
+    for (unsigned int i = 0; i < trace.size(); ++i)
+        os << trace[i].arrival << "," << trace[i].service << ","
+           << trace[i].timeout << "," << trace[i].nfailed << ","
+           << trace[i].exp_key << std::endl;
+}
+
+static std::vector<TraceJob>
+read_trace(const std::string& path){
+    std::ifstream is(path.c_str());
+    if(!is)
+        throw std::runtime_error("mdbq_trace: cannot open `" + path + "'");
+    std::vector<TraceJob> trace;
+    std::string line;
+    std::getline(is, line); // header
+    while(std::getline(is, line)){
+        if(line.empty())
+            continue;
+        std::istringstream ls(line);
+        TraceJob j;
+        char comma;
+        if(!(ls >> j.arrival >> comma >> j.service >> comma >> j.timeout >> comma >> j.nfailed >> comma))
+            throw std::runtime_error("mdbq_trace: malformed line `" + line + "'");
+        std::getline(ls, j.exp_key);
+        trace.push_back(j);
+    }
+    std::stable_sort(trace.begin(), trace.end());
+    return trace;
+}
+
+static double percentile(std::vector<double>& v, double p){
+    if(v.empty())
+        return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void
+report(std::ostream& os, const std::vector<Done>& done, unsigned int n_workers){
+    if(done.empty()){
+        os << "no jobs" << std::endl;
+        return;
+    }
+    double first = done[0].arrival, last = 0, busy = 0, sum = 0;
+    std::vector<double> delay;
+    delay.reserve(done.size());
+    for (unsigned int i = 0; i < done.size(); ++i)
+    {
+        first = std::min(first, done[i].arrival);
+        last  = std::max(last, done[i].end);
+        busy += done[i].busy;
+        delay.push_back(done[i].start - done[i].arrival);
+        sum  += delay.back();
+    }
+    double span = std::max(last - first, 1e-9);
+    os << "jobs          " << done.size() << std::endl;
+    os << "makespan      " << span << " s" << std::endl;
+    os << "throughput    " << done.size() / span * 3600. << " jobs/h" << std::endl;
+    os << "delay mean    " << sum / done.size() << " s" << std::endl;
+    os << "delay p50     " << percentile(delay, 0.5) << " s" << std::endl;
+    os << "delay p90     " << percentile(delay, 0.9) << " s" << std::endl;
+    os << "delay p99     " << percentile(delay, 0.99) << " s" << std::endl;
+    os << "delay max     " << *std::max_element(delay.begin(), delay.end()) << " s" << std::endl;
+    if(n_workers)
+        os << "utilization   " << busy / (n_workers * span) << std::endl;
+}
+
+/// time until the next poll, as drawn by Client::reg
+static double poll_interval(double interval){
+    if(interval <= 1.)
+        return interval/2 + drand48() * (interval/2);
+    return 1 + drand48() * (interval-1);
+}
+
+/// a job waiting in the simulated queue
+struct Pending{
+    double       ready;    ///< arrival, or end of the failed attempt
+    unsigned int seq;      ///< keeps jobs which are ready at the same time in order
+    unsigned int job;      ///< index into the trace
+    int          failures; ///< failed attempts still to come
+    double       busy;     ///< worker time of the attempts so far
+    bool operator>(const Pending& o)const{
+        return ready != o.ready ? ready > o.ready : seq > o.seq;
+    }
+};
+
+/**
+ * discrete event simulation of workers polling a FIFO queue.
+ *
+ * Each worker wakes up at its poll interval, claims up to batch jobs
+ * which are ready by then, and runs them back to back. A job which was
+ * rescheduled nfailed times in the trace fails as often first; a failed
+ * attempt holds the worker for the job's timeout (or its service time
+ * if it has none) and puts the job back into the queue.
+ */
+static std::vector<Done>
+simulate(const std::vector<TraceJob>& trace, unsigned int n_workers, double poll, unsigned int batch){
+    typedef std::pair<double, unsigned int> event; // wakeup time, worker
+    std::priority_queue<event, std::vector<event>, std::greater<event> > wakeups;
+    for (unsigned int w = 0; w < n_workers; ++w)
+        wakeups.push(event(drand48() * poll, w));
+
+    std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending> > queue;
+    unsigned int seq = 0;
+    for (unsigned int i = 0; i < trace.size(); ++i)
+    {
+        Pending p;
+        p.ready    = trace[i].arrival;
+        p.seq      = seq++;
+        p.job      = i;
+        p.failures = std::max(trace[i].nfailed, 0);
+        p.busy     = 0;
+        queue.push(p);
+    }
+
+    std::vector<Done> done;
+    done.reserve(trace.size());
+    while(!queue.empty()){
+        event ev = wakeups.top();
+        wakeups.pop();
+        double t = ev.first;
+        for (unsigned int b = 0; b < batch && !queue.empty() && queue.top().ready <= ev.first; ++b)
+        {
+            Pending p = queue.top();
+            queue.pop();
+            const TraceJob& j = trace[p.job];
+            if(p.failures > 0){
+                double run = j.timeout > 0 ? j.timeout : j.service;
+                t += run;
+                p.ready = t;
+                p.seq   = seq++;
+                p.busy += run;
+                p.failures--;
+                queue.push(p);
+                continue;
+            }
+            Done d;
+            d.arrival = j.arrival;
+            d.start   = t;
+            d.end     = t + j.service;
+            d.busy    = p.busy + j.service;
+            done.push_back(d);
+            t = d.end;
+        }
+        // an overdue timer fires right away
+        wakeups.push(event(std::max(t, ev.first + poll_interval(poll)), ev.second));
+    }
+    return done;
+}
+
+/// runs each task for its traced service time, scaled by speedup
+class ReplayWorker : public mdbq::Client{
+    public:
+        ReplayWorker(const std::string& host, const std::string& prefix, double speedup, unsigned int batch)
+            : Client(host, prefix), m_speedup(speedup), m_batch(batch){}
+        void handle_task(const mongo::BSONObj& task){
+            mongo::BSONObj t = task;
+            for (unsigned int b = 0; ; )
+            {
+                double s = t["service"].Number() / m_speedup;
+                boost::this_thread::sleep(boost::posix_time::microseconds((long long)(s * 1e6)));
+                finish(BSON("service" << s));
+                if(++b >= m_batch || !get_next_task(t))
+                    break;
+            }
+        }
+    private:
+        double m_speedup;
+        unsigned int m_batch;
+};
+
+static void run_worker(boost::asio::io_service* io){
+    io->run();
+}
+
+static std::vector<Done>
+replay(const std::vector<TraceJob>& trace, const std::string& host, const std::string& prefix,
+        unsigned int n_workers, double poll, unsigned int batch, double speedup){
+    mdbq::Hub hub(host, prefix);
+    hub.clear_all();
+
+    std::vector<boost::shared_ptr<boost::asio::io_service> > ios;
+    std::vector<boost::shared_ptr<ReplayWorker> > workers;
+    boost::thread_group threads;
+    for (unsigned int w = 0; w < n_workers; ++w)
+    {
+        ios.push_back(boost::shared_ptr<boost::asio::io_service>(new boost::asio::io_service));
+        workers.push_back(boost::shared_ptr<ReplayWorker>(new ReplayWorker(host, prefix, speedup, batch)));
+        workers.back()->reg(*ios.back(), poll / speedup);
+        threads.create_thread(boost::bind(run_worker, ios.back().get()));
+    }
+
+    boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+    for (unsigned int i = 0; i < trace.size(); ++i)
+    {
+        boost::posix_time::ptime at = t0 + boost::posix_time::microseconds(
+                (long long)(trace[i].arrival / speedup * 1e6));
+        boost::this_thread::sleep(at);
+        std::string driver = trace[i].exp_key.empty() ? "mdbq::hub" : trace[i].exp_key;
+        hub.insert_job(BSON("service" << trace[i].service), trace[i].timeout, driver);
+    }
+    while(hub.get_n_ok() + hub.get_n_failed() < trace.size())
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    for (unsigned int w = 0; w < n_workers; ++w)
+        ios[w]->stop();
+    threads.join_all();
+
+    // measure what actually happened, in trace time
+    mongo::DBClientConnection con;
+    con.connect(host);
+    std::vector<Done> done;
+    extract(con, prefix, &done);
+    for (unsigned int i = 0; i < done.size(); ++i)
+    {
+        done[i].arrival *= speedup;
+        done[i].start   *= speedup;
+        done[i].end     *= speedup;
+        done[i].busy    *= speedup;
+    }
+    return done;
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string cmd, host, prefix, trace_path;
+    unsigned int n_workers, batch;
+    double poll, speedup;
+    long seed;
+
+    po::options_description desc("mdbq_trace extract|simulate|replay [options]");
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("command", po::value<std::string>(&cmd), "extract, simulate or replay")
+        ("host", po::value<std::string>(&host)->default_value("localhost"), "MongoDB host")
+        ("prefix", po::value<std::string>(&prefix), "queue prefix (replay clears it!)")
+        ("trace,t", po::value<std::string>(&trace_path), "trace file, stdout for extract if omitted")
+        ("workers,w", po::value<unsigned int>(&n_workers)->default_value(1), "number of workers")
+        ("poll,p", po::value<double>(&poll)->default_value(1.), "poll interval of idle workers in seconds")
+        ("batch,b", po::value<unsigned int>(&batch)->default_value(1), "jobs claimed per poll")
+        ("speedup,s", po::value<double>(&speedup)->default_value(1.), "replay faster than real time")
+        ("seed", po::value<long>(&seed)->default_value(42), "random seed of the simulation")
+        ;
+    po::positional_options_description pos;
+    pos.add("command", 1);
+    po::variables_map vm;
+    try{
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+        po::notify(vm);
+    }catch(const po::error& e){
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if(vm.count("help") || cmd.empty()){
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+    if(!n_workers || !batch || poll <= 0 || speedup <= 0){
+        std::cerr << "workers, batch, poll and speedup must be positive" << std::endl;
+        return 1;
+    }
+    srand48(seed);
+
+    try{
+        if(cmd == "extract"){
+            if(prefix.empty())
+                throw std::runtime_error("mdbq_trace: --prefix is required");
+            mongo::DBClientConnection con;
+            con.connect(host);
+            std::vector<Done> done;
+            std::vector<TraceJob> trace = extract(con, prefix, &done);
+            if(trace_path.empty())
+                write_trace(std::cout, trace);
+            else{
+                std::ofstream os(trace_path.c_str());
+                write_trace(os, trace);
+            }
+            // what the real queue did, for comparison with simulations
+            report(std::cerr, done, 0);
+        }else if(cmd == "simulate"){
+            std::vector<Done> done = simulate(read_trace(trace_path), n_workers, poll, batch);
+            report(std::cout, done, n_workers);
+        }else if(cmd == "replay"){
+            if(prefix.empty())
+                throw std::runtime_error("mdbq_trace: --prefix is required");
+            std::vector<Done> done = replay(read_trace(trace_path), host, prefix, n_workers, poll, batch, speedup);
+            report(std::cout, done, n_workers);
+        }else{
+            std::cerr << "unknown command `" << cmd << "'" << std::endl << desc << std::endl;
+            return 1;
+        }
+    }catch(const std::exception& e){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}